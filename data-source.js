@@ -0,0 +1,59 @@
+"use strict";
+
+/**
+ * Loads the generated JSON documents by name, e.g., 'subtree-3'. They are
+ * read from separate files data/<name>.json or, if the pack index
+ * data/tree-index.json exists, with HTTP Range requests from the single
+ * pack file data/tree.pack written by bin/main --pack.
+ */
+function DataSource() {
+    
+    var pack_index = null;
+    // the whole pack, if the server ignored a Range header
+    var whole_pack = null;
+    var ready = false;
+    var pending = [];
+    
+    /** The document of the given pack bytes as an object */
+    function parseBytes(buffer, first, end) {
+        return JSON.parse(new TextDecoder('utf-8').decode(new Uint8Array(buffer, first, end - first)));
+    }
+    
+    function fetch(name, callback) {
+        var entry = pack_index ? pack_index[name] : undefined;
+        if (entry) {
+            var first = entry[0], end = entry[0] + entry[1];
+            if (whole_pack) return callback(null, parseBytes(whole_pack, first, end));
+            d3.xhr('data/tree.pack')
+                .header('Range', 'bytes=' + first + '-' + (end - 1))
+                .responseType('arraybuffer')
+                .get(function (error, request) {
+                    if (error) return callback(error);
+                    var buffer = request.response;
+                    if (request.status == 206) return callback(null, parseBytes(buffer, 0, buffer.byteLength));
+                    if (request.status != 200 || buffer.byteLength < end)
+                        return callback(new Error('unexpected response to a Range request for ' + name));
+                    whole_pack = buffer;
+                    callback(null, parseBytes(buffer, first, end));
+                });
+        }
+        else {
+            d3.json('data/' + name + '.json', callback);
+        }
+    }
+    
+    d3.json('data/tree-index.json', function (error, index) {
+        if (!error) pack_index = index;
+        ready = true;
+        pending.forEach(function (p) { fetch(p.name, p.callback); });
+        pending = [];
+    });
+    
+    /** callback(error, data) like in d3.json */
+    this.json = function (name, callback) {
+        if (ready) fetch(name, callback);
+        else pending.push({ name: name, callback: callback });
+    };
+}
+
+var data_source = new DataSource();
@@ -0,0 +1,177 @@
+#ifndef __ANCESTRY_HPP
+#define __ANCESTRY_HPP
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include <tree.hpp>
+
+/**
+ * Depth, parent, path-to-root and lowest common ancestor queries over a
+ * TreeOfLife, or over a tree given by a parent map, by node id.
+ *
+ * The LCA of u != v is the parent of the shallowest node in the preorder
+ * range (pos(u), pos(v)], where pos(u) < pos(v). This is the Euler tour
+ * reduction to range minimum queries without the repeated entries. The
+ * range minima are answered with a sparse table over blocks of the
+ * preorder and a scan within the (at most two) partial blocks, which keeps
+ * the index linear in size and the queries constant time.
+ */
+class AncestorIndex {
+public:
+    typedef std::runtime_error error;
+
+    AncestorIndex(const TreeOfLife &tree) {
+        build(tree, -1, 0);
+        build_sparse_table();
+    }
+
+    /** The tree of the ids in parent_map, which maps each but the root to its parent */
+    AncestorIndex(const std::map<int,int> &parent_map, int root) {
+        Children children;
+        for (std::map<int,int>::const_iterator itr = parent_map.begin();
+            itr != parent_map.end(); ++itr)
+            children[itr->second].push_back(itr->first);
+
+        build(children, root, -1, 0);
+        if (size() != parent_map.size() + 1) throw error("parent map is not a tree");
+        build_sparse_table();
+    }
+
+    size_t size() const { return order.size(); }
+
+    bool contains(int id) const {
+        return id >= 0 && id < int(pos.size()) && pos[id] != NONE;
+    }
+
+    int depth(int id) const { return depths[position(id)]; }
+
+    /** The id of the parent node, or -1 for the root */
+    int parent(int id) const { return parents[position(id)]; }
+
+    /** Node ids from the given node up to the root, inclusive */
+    std::vector<int> path_to_root(int id) const {
+        std::vector<int> path;
+        path.reserve(depth(id) + 1);
+        for (; id != -1; id = parent(id)) path.push_back(id);
+        return path;
+    }
+
+    /** True if a is b or an ancestor of b */
+    bool is_ancestor(int a, int b) const {
+        const int pa = position(a), pb = position(b);
+        return pa <= pb && pb < pa + sizes[pa];
+    }
+
+    int lca(int a, int b) const {
+        int pa = position(a), pb = position(b);
+        if (pa == pb) return a;
+        if (pa > pb) std::swap(pa, pb);
+        if (pb < pa + sizes[pa]) return order[pa];
+        return parents[range_min(pa + 1, pb)];
+    }
+
+private:
+    static const int NONE = -1;
+    static const int BLOCK = 32;
+
+    // indexed by node id
+    std::vector<int> pos;
+
+    // indexed by preorder position
+    std::vector<int> order, parents, depths, sizes;
+
+    // sparse_table[k][b] = position of the shallowest node in blocks b..b+2^k-1
+    std::vector< std::vector<int> > sparse_table;
+
+    int position(int id) const {
+        if (!contains(id)) throw error("unknown node id "+to_string(id));
+        return pos[id];
+    }
+
+    typedef std::map< int, std::vector<int> > Children;
+
+    /** Appends the node in preorder and returns its position */
+    int add(int id, int parent, int depth) {
+        const int p = order.size();
+        if (id < 0) throw error("negative node id "+to_string(id));
+        if (id >= int(pos.size())) pos.resize(id*2 + 1, int(NONE));
+        if (pos[id] != NONE) throw error("duplicate node id "+to_string(id));
+        pos[id] = p;
+
+        order.push_back(id);
+        parents.push_back(parent);
+        depths.push_back(depth);
+        sizes.push_back(1);
+        return p;
+    }
+
+    int build(const TreeOfLife &tree, int parent, int depth) {
+        const int p = add(tree.id, parent, depth);
+
+        int size = 1;
+        for (TreeOfLife::const_iterator itr = tree.children.begin();
+            itr != tree.children.end(); ++itr)
+            size += build(*itr, tree.id, depth + 1);
+
+        sizes[p] = size;
+        return size;
+    }
+
+    int build(const Children &children, int id, int parent, int depth) {
+        const int p = add(id, parent, depth);
+
+        int size = 1;
+        Children::const_iterator found = children.find(id);
+        if (found != children.end()) {
+            for (size_t i = 0; i < found->second.size(); ++i)
+                size += build(children, found->second[i], id, depth + 1);
+        }
+
+        sizes[p] = size;
+        return size;
+    }
+
+    int shallower(int a, int b) const { return depths[b] < depths[a] ? b : a; }
+
+    int scan_min(int begin, int end) const {
+        int best = begin;
+        for (int i = begin + 1; i <= end; ++i) best = shallower(best, i);
+        return best;
+    }
+
+    void build_sparse_table() {
+        const int n_blocks = (size() + BLOCK - 1) / BLOCK;
+
+        sparse_table.push_back(std::vector<int>(n_blocks));
+        for (int b = 0; b < n_blocks; ++b)
+            sparse_table[0][b] = scan_min(b*BLOCK, std::min(int(size()), (b+1)*BLOCK) - 1);
+
+        for (int k = 1; (1 << k) <= n_blocks; ++k) {
+            const std::vector<int> &prev = sparse_table[k-1];
+            std::vector<int> level(n_blocks - (1 << k) + 1);
+            for (size_t b = 0; b < level.size(); ++b)
+                level[b] = shallower(prev[b], prev[b + (1 << (k-1))]);
+            sparse_table.push_back(level);
+        }
+    }
+
+    /** Position of the shallowest node in the inclusive range [l, r] */
+    int range_min(int l, int r) const {
+        const int bl = l / BLOCK, br = r / BLOCK;
+        if (br - bl <= 1) return scan_min(l, r);
+
+        int best = shallower(scan_min(l, (bl+1)*BLOCK - 1), scan_min(br*BLOCK, r));
+
+        const int first = bl + 1, n = br - first;
+        int k = 0;
+        while ((2 << k) <= n) k++;
+        best = shallower(best, sparse_table[k][first]);
+        best = shallower(best, sparse_table[k][br - (1 << k)]);
+        return best;
+    }
+};
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef __ASYNC_OUTPUT_HPP
+#define __ASYNC_OUTPUT_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <output.hpp>
+
+/** A minimal io_uring submission/completion queue pair */
+class IoUring {
+public:
+    typedef std::runtime_error error;
+
+    IoUring(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) throw error("io_uring_setup failed: "+std::string(strerror(errno)));
+
+        sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+        sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap ? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*)map(sqes_size, IORING_OFF_SQES);
+
+        char *sq = (char*)sq_ptr, *cq = (char*)cq_ptr;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        capacity = params.sq_entries;
+        local_tail = *sq_tail;
+        to_submit = 0;
+    }
+
+    ~IoUring() {
+        munmap(sqes, sqes_size);
+        if (!single_mmap) munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        close(fd);
+    }
+
+    unsigned size() const { return capacity; }
+
+    /** A zeroed submission queue entry, or NULL if the queue is full */
+    io_uring_sqe *next_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= capacity) return NULL;
+
+        unsigned index = local_tail & sq_mask;
+        sq_array[index] = index;
+        local_tail++;
+        to_submit++;
+
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /**
+     * A zeroed submission queue entry like next_sqe, but if the queue is
+     * full, submits the queued entries to the kernel first to free it
+     */
+    io_uring_sqe *acquire_sqe() {
+        io_uring_sqe *sqe = next_sqe();
+        while (sqe == NULL) {
+            submit(0);
+            sqe = next_sqe();
+        }
+        return sqe;
+    }
+
+    /** Submits the queued entries and waits for at least min_complete */
+    void submit(unsigned min_complete) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        while (true) {
+            int r = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (r >= 0) {
+                to_submit -= r;
+                if (to_submit == 0 || min_complete > 0) return;
+            }
+            else if (errno != EINTR) throw error("io_uring_enter failed: "+std::string(strerror(errno)));
+        }
+    }
+
+    bool next_cqe(io_uring_cqe &cqe) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd;
+    bool single_mmap;
+    size_t sq_size, cq_size, sqes_size;
+    void *sq_ptr, *cq_ptr;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    unsigned *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned sq_mask, cq_mask, capacity;
+    unsigned local_tail, to_submit;
+
+    IoUring(const IoUring&);
+    IoUring& operator=(const IoUring&);
+
+    void *map(size_t size, off_t offset) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        if (p == MAP_FAILED) {
+            close(fd);
+            throw error("io_uring mmap failed");
+        }
+        return p;
+    }
+};
+
+/**
+ * Writes each document to the file <prefix><name>.json like DirectorySink,
+ * but in a background thread so that formatting overlaps with disk I/O.
+ * The writer thread takes the queued documents in batches and submits the
+ * writes of a whole batch at once through io_uring, or, if io_uring is not
+ * available, writes them one by one.
+ */
+class AsyncDirectorySink : public OutputSink {
+public:
+    enum Backend { IO_URING, THREAD };
+    enum FsyncPolicy { FSYNC_NONE, FSYNC_EACH, FSYNC_END };
+
+    AsyncDirectorySink(std::string prefix_,
+                       Backend backend_ = IO_URING,
+                       FsyncPolicy fsync_policy_ = FSYNC_NONE,
+                       size_t max_pending_bytes_ = 256 << 20) :
+        prefix(prefix_),
+        backend(backend_),
+        fsync_policy(fsync_policy_),
+        max_pending_bytes(max_pending_bytes_),
+        pending_bytes(0),
+        finishing(false),
+        finished(false)
+    {
+        if (backend == IO_URING) {
+            try { ring.reset(new IoUring(QUEUE_DEPTH)); }
+            catch (IoUring::error &) { backend = THREAD; }
+        }
+        writer = std::thread(&AsyncDirectorySink::run, this);
+    }
+
+    ~AsyncDirectorySink() {
+        try { finish(); }
+        catch (...) {}
+    }
+
+    /** The backend in use, THREAD if io_uring was requested but not available */
+    Backend active_backend() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return backend;
+    }
+
+    void write(const std::string &name, const std::string &payload) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (pending_bytes > max_pending_bytes && !failure) queue_changed.wait(lock);
+        check_failure();
+
+        Job job = { prefix + name + ".json", payload };
+        queue.push_back(job);
+        pending_bytes += payload.size();
+        queue_changed.notify_all();
+    }
+
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (finished) return;
+            finished = finishing = true;
+            queue_changed.notify_all();
+        }
+        writer.join();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        check_failure();
+        // the writer thread is done, so the ring and the file list are ours
+        if (fsync_policy == FSYNC_END) sync_written_files();
+    }
+
+    static FsyncPolicy parse_fsync_policy(const std::string &str) {
+        if (str == "none") return FSYNC_NONE;
+        if (str == "each") return FSYNC_EACH;
+        if (str == "end") return FSYNC_END;
+        throw error("unknown fsync policy "+str);
+    }
+
+private:
+    static const unsigned QUEUE_DEPTH = 64;
+
+    struct Unsupported {};
+
+    struct Job {
+        std::string filename;
+        std::string payload;
+    };
+
+    const std::string prefix;
+    Backend backend;
+    const FsyncPolicy fsync_policy;
+    const size_t max_pending_bytes;
+
+    std::unique_ptr<IoUring> ring;
+    std::thread writer;
+
+    mutable std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::deque<Job> queue;
+    size_t pending_bytes;
+    bool finishing, finished;
+    std::exception_ptr failure;
+
+    // the files to flush on finish with FSYNC_END, only used by the writer
+    // thread until it is joined
+    std::vector<std::string> written_files;
+
+    void set_backend(Backend b) {
+        std::lock_guard<std::mutex> lock(mutex);
+        backend = b;
+    }
+
+    void check_failure() { if (failure) std::rethrow_exception(failure); }
+
+    void run() {
+        try {
+            std::vector<Job> batch;
+            while (take_batch(batch)) {
+                if (backend == IO_URING) {
+                    try { write_batch_io_uring(batch); }
+                    catch (Unsupported &) {
+                        // kernels before 5.6 have io_uring without IORING_OP_WRITE
+                        set_backend(THREAD);
+                        write_batch_blocking(batch);
+                    }
+                }
+                else write_batch_blocking(batch);
+
+                size_t bytes = 0;
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    bytes += batch[i].payload.size();
+                    if (fsync_policy == FSYNC_END) written_files.push_back(batch[i].filename);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                pending_bytes -= bytes;
+                queue_changed.notify_all();
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            failure = std::current_exception();
+            queue_changed.notify_all();
+        }
+    }
+
+    /** Waits for queued jobs, returns false when finished and drained */
+    bool take_batch(std::vector<Job> &batch) {
+        batch.clear();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (queue.empty() && !finishing) queue_changed.wait(lock);
+        if (queue.empty()) return false;
+
+        const size_t max_batch = ring ? ring->size() / 2 : QUEUE_DEPTH;
+        while (!queue.empty() && batch.size() < max_batch) {
+            batch.push_back(Job());
+            std::swap(batch.back(), queue.front());
+            queue.pop_front();
+        }
+        return true;
+    }
+
+    static int open_file(const std::string &filename) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw error("could not open "+filename);
+        return fd;
+    }
+
+    void write_batch_blocking(const std::vector<Job> &batch) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            int fd = open_file(batch[i].filename);
+            const std::string &payload = batch[i].payload;
+            size_t written = 0;
+            while (written < payload.size()) {
+                ssize_t n = ::write(fd, payload.data() + written, payload.size() - written);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    close(fd);
+                    throw error("could not write "+batch[i].filename);
+                }
+                written += n;
+            }
+            if (fsync_policy == FSYNC_EACH && fsync(fd) != 0) {
+                close(fd);
+                throw error("could not fsync "+batch[i].filename);
+            }
+            close(fd);
+        }
+    }
+
+    void write_batch_io_uring(const std::vector<Job> &batch) {
+        std::vector<int> fds;
+        std::vector<size_t> written(batch.size(), 0);
+
+        try {
+            for (size_t i = 0; i < batch.size(); ++i) fds.push_back(open_file(batch[i].filename));
+
+            // resubmit until all writes are complete, short writes are rare
+            while (true) {
+                unsigned submitted = 0;
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    const std::string &payload = batch[i].payload;
+                    if (written[i] == payload.size()) continue;
+
+                    io_uring_sqe *sqe = ring->acquire_sqe();
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->fd = fds[i];
+                    sqe->addr = (unsigned long)(payload.data() + written[i]);
+                    sqe->len = payload.size() - written[i];
+                    sqe->off = written[i];
+                    sqe->user_data = i;
+                    submitted++;
+                }
+                if (submitted == 0) break;
+
+                for (unsigned done = 0; done < submitted; ++done) {
+                    io_uring_cqe cqe;
+                    while (!ring->next_cqe(cqe)) ring->submit(1);
+                    if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) throw Unsupported();
+                    if (cqe.res <= 0) throw error("could not write "+batch[cqe.user_data].filename);
+                    written[cqe.user_data] += cqe.res;
+                }
+            }
+
+            if (fsync_policy == FSYNC_EACH) {
+                const int failed = fsync_io_uring(fds);
+                if (failed >= 0) throw error("could not fsync "+batch[failed].filename);
+            }
+        }
+        catch (...) {
+            for (size_t i = 0; i < fds.size(); ++i) close(fds[i]);
+            throw;
+        }
+
+        for (size_t i = 0; i < fds.size(); ++i) close(fds[i]);
+    }
+
+    /** Submits an fsync of each file at once, returns the index of a failed one or -1 */
+    int fsync_io_uring(const std::vector<int> &fds) {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            io_uring_sqe *sqe = ring->acquire_sqe();
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fds[i];
+            sqe->user_data = i;
+        }
+        int failed = -1;
+        for (size_t done = 0; done < fds.size(); ++done) {
+            io_uring_cqe cqe;
+            while (!ring->next_cqe(cqe)) ring->submit(1);
+            if (cqe.res < 0) failed = cqe.user_data;
+        }
+        return failed;
+    }
+
+    /**
+     * Flushes the files written by this sink, in batches like the writes,
+     * and then the directory that holds their entries
+     */
+    void sync_written_files() {
+        const size_t max_batch = ring ? ring->size() / 2 : QUEUE_DEPTH;
+        for (size_t begin = 0; begin < written_files.size(); begin += max_batch) {
+            const size_t end = std::min(written_files.size(), begin + max_batch);
+            std::vector<int> fds;
+            int failed = -1;
+            for (size_t i = begin; i < end && failed < 0; ++i) {
+                fds.push_back(open(written_files[i].c_str(), O_RDONLY | O_CLOEXEC));
+                if (fds.back() < 0) {
+                    fds.pop_back();
+                    failed = i - begin;
+                }
+            }
+            if (failed < 0 && backend == IO_URING) failed = fsync_io_uring(fds);
+            else if (failed < 0) {
+                for (size_t i = 0; i < fds.size() && failed < 0; ++i)
+                    if (fsync(fds[i]) != 0) failed = i;
+            }
+            for (size_t i = 0; i < fds.size(); ++i) close(fds[i]);
+            if (failed >= 0) throw error("could not fsync "+written_files[begin + failed]);
+        }
+        written_files.clear();
+
+        size_t slash = prefix.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : prefix.substr(0, slash + 1);
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) throw error("could not open "+dir);
+        int r = fsync(fd);
+        close(fd);
+        if (r != 0) throw error("could not fsync "+dir);
+    }
+};
+
+#endif
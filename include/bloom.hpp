@@ -0,0 +1,99 @@
+#ifndef __BLOOM_HPP
+#define __BLOOM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * A Bloom filter of byte strings. The k bit positions of a string are
+ * (h1 + i*h2) mod m for i < k, where h1 and h2 are 32-bit FNV-1a hashes
+ * with different offset bases, computed the same way in search.js.
+ */
+class BloomFilter {
+public:
+    /** Incremental hashes, so that all prefixes of a string take one pass */
+    struct Hash {
+        uint32_t h1, h2;
+
+        Hash() : h1(2166136261u), h2(0x5bd1e995u) {}
+
+        void update(const char *bytes, size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                const uint8_t b = bytes[i];
+                h1 = (h1 ^ b) * 16777619u;
+                h2 = (h2 ^ b) * 16777619u;
+            }
+        }
+
+        void update(std::string_view bytes) { update(bytes.data(), bytes.size()); }
+    };
+
+    /** About bits_per_item bits for each of the n_items strings */
+    BloomFilter(size_t n_items, double bits_per_item) {
+        const size_t n_bits = std::max(size_t(64), size_t(std::ceil(n_items * bits_per_item)));
+        bits.assign((n_bits + 7) / 8, 0);
+        n_hashes = std::max(1, int(std::lround(bits_per_item * std::log(2.0))));
+    }
+
+    void add(const Hash &hash) {
+        for (int i = 0; i < n_hashes; ++i) {
+            const uint32_t bit = position(hash, i);
+            bits[bit / 8] |= uint8_t(1 << (bit % 8));
+        }
+    }
+
+    void add(std::string_view bytes) {
+        Hash hash;
+        hash.update(bytes);
+        add(hash);
+    }
+
+    /** False only if the string was not added */
+    bool may_contain(const Hash &hash) const {
+        for (int i = 0; i < n_hashes; ++i) {
+            const uint32_t bit = position(hash, i);
+            if (!(bits[bit / 8] & (1 << (bit % 8)))) return false;
+        }
+        return true;
+    }
+
+    bool may_contain(std::string_view bytes) const {
+        Hash hash;
+        hash.update(bytes);
+        return may_contain(hash);
+    }
+
+    size_t size_bits() const { return bits.size() * 8; }
+    int hashes() const { return n_hashes; }
+
+    /** The bit array, bit i in byte i/8 from the least significant bit */
+    std::string to_base64() const {
+        static const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string str;
+        str.reserve((bits.size() + 2) / 3 * 4);
+        for (size_t i = 0; i < bits.size(); i += 3) {
+            const size_t n = std::min(size_t(3), bits.size() - i);
+            uint32_t group = uint32_t(bits[i]) << 16;
+            if (n > 1) group |= uint32_t(bits[i+1]) << 8;
+            if (n > 2) group |= bits[i+2];
+            for (size_t j = 0; j < 4; ++j)
+                str += j <= n ? alphabet[(group >> (18 - 6*j)) & 0x3f] : '=';
+        }
+        return str;
+    }
+
+private:
+    std::vector<uint8_t> bits;
+    int n_hashes;
+
+    uint32_t position(const Hash &hash, int i) const {
+        return uint32_t(hash.h1 + uint32_t(i) * (hash.h2 | 1)) % uint32_t(bits.size() * 8);
+    }
+};
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef __EXTRACT_HPP
+#define __EXTRACT_HPP
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <newick.hpp>
+#include <tree.hpp>
+
+/**
+ * Finds clades by name or OTT id in Newick text without parsing it into a
+ * TreeOfLife. One pass over the NewickIndex matches the brackets and
+ * reads the names, so only the found clade needs to be parsed.
+ */
+class NewickClades {
+public:
+    typedef std::runtime_error error;
+
+    struct Clade {
+        // the clade is the text [begin, end), without the final ';'
+        size_t begin, end;
+        // the preorder id of its root in the whole tree, as in bin/main
+        int id;
+        std::string name, ext_id;
+    };
+
+    /** Maps a Newick file */
+    NewickClades(std::string filename) : p_index(NULL) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw error("could not open "+filename);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw error("could not stat "+filename);
+        }
+        size = st.st_size;
+
+        mapped = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        close(fd);
+        if (mapped == MAP_FAILED) throw error("could not map "+filename);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char*)mapped;
+
+        p_index = new NewickIndex(data, size);
+    }
+
+    /** Newick text in memory, which must outlive this */
+    NewickClades(const char *data_, size_t size_) :
+        data(data_), size(size_), mapped(NULL), p_index(new NewickIndex(data_, size_))
+    {}
+
+    ~NewickClades() {
+        delete p_index;
+        if (mapped != NULL) munmap(mapped, size);
+    }
+
+    /**
+     * The clades whose name or ext_id is the query. A query "ottN" or "N"
+     * is an OTT id, which stops at the first match; underscores in names
+     * stand for spaces as in Newick.
+     */
+    std::vector<Clade> find(std::string query) const {
+        const bool by_id = is_ott_id(query);
+        if (by_id && query.substr(0, 3) != "ott") query = "ott" + query;
+        if (!by_id) {
+            for (size_t i = 0; i < query.size(); ++i)
+                if (query[i] == '_') query[i] = ' ';
+        }
+
+        std::vector<Clade> found;
+        // structural '(' positions and the ids of their nodes
+        std::vector< std::pair<size_t, int> > opened;
+        std::string name, ext_id;
+
+        // the name being read, if any, and its node
+        bool in_name = size > 0 && data[0] != '(';
+        size_t name_begin = 0, clade_begin = 0;
+        int name_id = 1;
+        // the '(' and ',' seen so far, i.e., the nodes started after the root
+        int n_started = 0;
+
+        const NewickIndex &index = *p_index;
+        for (size_t i = 0; i <= index.size(); ++i) {
+            const size_t p = i < index.size() ? index[i] : size;
+            const char c = p < size ? data[p] : ';';
+            if (c == '\'') continue;
+
+            if (c == '(') {
+                // unless it starts a node, '(' is an ordinary name character
+                if (p != clade_begin) continue;
+                opened.push_back(std::make_pair(p, n_started + 1));
+                n_started++;
+                start_child(p, n_started, in_name, name_begin, clade_begin, name_id);
+                continue;
+            }
+
+            if (in_name && might_match(name_begin, p, query, by_id)) {
+                read_name(name_begin, p, name, ext_id);
+                if ((by_id ? ext_id : name) == query) {
+                    Clade clade = { clade_begin, p, name_id, name, ext_id };
+                    found.push_back(clade);
+                    if (by_id) break;
+                }
+            }
+            in_name = false;
+
+            if (c == ',') {
+                n_started++;
+                start_child(p, n_started, in_name, name_begin, clade_begin, name_id);
+            }
+            else if (c == ')') {
+                if (opened.empty()) throw error("unmatched ) at byte "+to_string(p));
+                in_name = true;
+                name_begin = p + 1;
+                clade_begin = opened.back().first;
+                name_id = opened.back().second;
+                opened.pop_back();
+            }
+            else if (c == ';') break;
+        }
+        return found;
+    }
+
+    /** The clade as a Newick tree */
+    std::string newick(const Clade &clade) const {
+        return std::string(data + clade.begin, clade.end - clade.begin) + ";";
+    }
+
+    /** Parses the clade only, with the same ids as in the whole tree */
+    TreeOfLife parse(const Clade &clade) const {
+        return TreeOfLife(data + clade.begin, clade.end - clade.begin, clade.id);
+    }
+
+    size_t bytes() const { return size; }
+
+private:
+    const char *data;
+    size_t size;
+    void *mapped;
+    const NewickIndex *p_index;
+
+    NewickClades(const NewickClades&);
+    NewickClades &operator=(const NewickClades&);
+
+    static bool is_ott_id(const std::string &query) {
+        const size_t digits = query.substr(0, 3) == "ott" ? 3 : 0;
+        if (query.size() == digits) return false;
+        for (size_t i = digits; i < query.size(); ++i)
+            if (query[i] < '0' || query[i] > '9') return false;
+        return true;
+    }
+
+    /** A child starts after the '(' or ',' at p, a leaf unless it opens */
+    void start_child(size_t p, int n_started, bool &in_name,
+                     size_t &name_begin, size_t &clade_begin, int &name_id) const {
+        in_name = p + 1 >= size || data[p+1] != '(';
+        name_begin = clade_begin = p + 1;
+        name_id = n_started + 1;
+    }
+
+    /** A quick test of the raw Newick name [begin, end) before read_name */
+    bool might_match(size_t begin, size_t end, const std::string &query, bool by_id) const {
+        const size_t n = query.size();
+        if (begin < end && data[begin] == '\'') return true;
+        if (by_id) return end - begin >= n && memcmp(data + end - n, query.data(), n) == 0;
+
+        while (begin < end && (data[begin] == ' ' || data[begin] == '_')) begin++;
+        if (end - begin <= n || (data[begin + n] != ' ' && data[begin + n] != '_')) return false;
+        for (size_t i = 0; i < n; ++i) {
+            const char c = data[begin + i];
+            if (c != query[i] && !(c == '_' && query[i] == ' ')) return false;
+        }
+        return true;
+    }
+
+    /** The name and ext_id of the Newick name [begin, end), see TreeOfLife::set_name */
+    void read_name(size_t begin, size_t end, std::string &name, std::string &ext_id) const {
+        name.clear();
+        ext_id.clear();
+        if (begin < end && data[begin] == '\'') {
+            const size_t last = end > begin + 1 && data[end-1] == '\'' ? end - 1 : end;
+            for (size_t i = begin + 1; i < last; ++i) {
+                name += data[i];
+                if (data[i] == '\'') i++; // doubled quote
+            }
+        }
+        else name.assign(data + begin, end - begin);
+
+        for (size_t i = 0; i < name.size(); ++i)
+            if (name[i] == '_') name[i] = ' ';
+
+        const size_t name_begin = name.find_first_not_of(' ');
+        const size_t id_begin = name.find_last_of(' ');
+        if (name_begin == std::string::npos || id_begin == std::string::npos || id_begin < name_begin) {
+            name.clear();
+            return;
+        }
+        ext_id.assign(name, id_begin + 1, std::string::npos);
+        name = name.substr(name_begin, id_begin - name_begin);
+    }
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef __HTTP_HPP
+#define __HTTP_HPP
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <json.hpp>
+
+/**
+ * A minimal single-threaded HTTP/1.1 server for GET requests, built on a
+ * non-blocking epoll event loop. Connections are kept alive unless the
+ * client asks otherwise and pipelined requests are answered in order.
+ */
+class HttpServer {
+public:
+    typedef std::runtime_error error;
+
+    struct Request {
+        std::string method, path;
+        std::map<std::string, std::string> query;
+        bool keep_alive;
+
+        std::string param(const std::string &key, const std::string &def = "") const {
+            std::map<std::string, std::string>::const_iterator itr = query.find(key);
+            return itr == query.end() ? def : itr->second;
+        }
+
+        int int_param(const std::string &key, int def) const {
+            std::string v = param(key);
+            return v.empty() ? def : atoi(v.c_str());
+        }
+    };
+
+    struct Response {
+        int status;
+        std::string content_type;
+        std::string body;
+
+        Response(int status_ = 200, std::string body_ = "",
+                 std::string content_type_ = "application/json") :
+            status(status_), content_type(content_type_), body(body_) {}
+    };
+
+    typedef std::function<Response(const Request&)> Handler;
+
+    HttpServer(int port, Handler handler_) : handler(handler_) {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listen_fd < 0) throw error("socket failed");
+
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, SOMAXCONN) != 0) {
+            close(listen_fd);
+            throw error("could not listen on port "+to_string(port));
+        }
+
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) throw error("epoll_create1 failed");
+        watch(listen_fd, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    ~HttpServer() {
+        for (std::map<int, Connection>::iterator itr = connections.begin();
+            itr != connections.end(); ++itr)
+            close(itr->first);
+        close(epoll_fd);
+        close(listen_fd);
+    }
+
+    /** Runs the event loop forever */
+    void run() {
+        const int MAX_EVENTS = 256;
+        epoll_event events[MAX_EVENTS];
+
+        while (true) {
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw error("epoll_wait failed");
+            }
+
+            for (int i = 0; i < n; ++i) {
+                const int fd = events[i].data.fd;
+                if (fd == listen_fd) accept_all();
+                else if (events[i].events & (EPOLLERR | EPOLLHUP)) drop(fd);
+                else {
+                    if (events[i].events & EPOLLIN) on_readable(fd);
+                    if (connections.count(fd) && (events[i].events & EPOLLOUT))
+                        serve(fd);
+                }
+            }
+        }
+    }
+
+    /**
+     * Parses the request line and headers of a complete request head,
+     * e.g., "GET /node?id=1 HTTP/1.1\r\nHost: x\r\n\r\n"
+     */
+    static bool parse_request(const std::string &head, Request &request) {
+        size_t line_end = head.find("\r\n");
+        std::string line = head.substr(0, line_end);
+
+        size_t sp1 = line.find(' ');
+        size_t sp2 = line.rfind(' ');
+        if (sp1 == std::string::npos || sp2 <= sp1) return false;
+
+        request.method = line.substr(0, sp1);
+        std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        std::string version = line.substr(sp2 + 1);
+
+        request.keep_alive = version == "HTTP/1.1";
+        request.query.clear();
+
+        size_t q = target.find('?');
+        request.path = url_decode(target.substr(0, q));
+        if (q != std::string::npos) {
+            std::string query = target.substr(q + 1);
+            size_t begin = 0;
+            while (begin <= query.size()) {
+                size_t end = query.find('&', begin);
+                if (end == std::string::npos) end = query.size();
+                std::string pair = query.substr(begin, end - begin);
+                size_t eq = pair.find('=');
+                if (!pair.empty()) {
+                    if (eq == std::string::npos) request.query[url_decode(pair)] = "";
+                    else request.query[url_decode(pair.substr(0, eq))] =
+                        url_decode(pair.substr(eq + 1));
+                }
+                begin = end + 1;
+            }
+        }
+
+        // headers, only Connection matters here
+        size_t pos = line_end;
+        while (pos != std::string::npos && pos + 2 < head.size()) {
+            size_t next = head.find("\r\n", pos + 2);
+            std::string header = head.substr(pos + 2, next - pos - 2);
+            size_t colon = header.find(':');
+            if (colon != std::string::npos) {
+                std::string name = lower(header.substr(0, colon));
+                std::string value = lower(header.substr(colon + 1));
+                if (name == "connection") {
+                    if (value.find("close") != std::string::npos) request.keep_alive = false;
+                    if (value.find("keep-alive") != std::string::npos) request.keep_alive = true;
+                }
+            }
+            pos = next;
+        }
+        return true;
+    }
+
+    static std::string url_decode(const std::string &str) {
+        std::string out;
+        for (size_t i = 0; i < str.size(); ++i) {
+            if (str[i] == '+') out += ' ';
+            else if (str[i] == '%' && i + 2 < str.size() &&
+                isxdigit((unsigned char)str[i + 1]) && isxdigit((unsigned char)str[i + 2])) {
+                out += char(strtol(str.substr(i + 1, 2).c_str(), NULL, 16));
+                i += 2;
+            }
+            // an invalid escape is taken as it is
+            else out += str[i];
+        }
+        return out;
+    }
+
+private:
+    struct Connection {
+        std::string in, out;
+        size_t out_pos;
+        bool close_after;
+        bool peer_closed;
+        bool waiting_output; // registered for EPOLLOUT
+
+        Connection() :
+            out_pos(0), close_after(false), peer_closed(false), waiting_output(false) {}
+    };
+
+    static const size_t MAX_REQUEST_SIZE = 16*1024;
+    // beyond this many unsent response bytes, no more requests are parsed
+    static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+    Handler handler;
+    int listen_fd, epoll_fd;
+    std::map<int, Connection> connections;
+
+    // non-copyable
+    HttpServer(const HttpServer&);
+    HttpServer& operator=(const HttpServer&);
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, op, fd, &ev) != 0) throw error("epoll_ctl failed");
+    }
+
+    void accept_all() {
+        while (true) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+            if (fd < 0) return; // EAGAIN or a transient error
+
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            connections[fd] = Connection();
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+        }
+    }
+
+    void drop(int fd) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        connections.erase(fd);
+    }
+
+    void on_readable(int fd) {
+        Connection &conn = connections[fd];
+        char buf[8192];
+
+        // beyond the limit, the rest stays in the socket until the buffered
+        // requests are answered
+        while (conn.in.size() <= MAX_REQUEST_SIZE) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn.in.append(buf, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                drop(fd);
+                return;
+            }
+            // half-closed by the peer, answer what it has sent
+            conn.peer_closed = true;
+            break;
+        }
+
+        serve(fd);
+    }
+
+    /**
+     * Answers the buffered requests and sends the responses. With many
+     * pipelined requests and a client that does not read, parsing pauses
+     * at MAX_PENDING_OUTPUT and resumes once the output has been sent.
+     */
+    void serve(int fd) {
+        bool blocked;
+        do {
+            blocked = answer_buffered(connections[fd]);
+        } while (flush(fd, blocked) && blocked);
+    }
+
+    /** Returns true if it stopped at the output limit */
+    bool answer_buffered(Connection &conn) {
+        bool blocked = false;
+        while (!conn.close_after) {
+            if (conn.out.size() - conn.out_pos > MAX_PENDING_OUTPUT) {
+                blocked = true;
+                break;
+            }
+            size_t head_end = conn.in.find("\r\n\r\n");
+            if (head_end == std::string::npos) break;
+
+            std::string head = conn.in.substr(0, head_end + 2);
+            conn.in.erase(0, head_end + 4);
+
+            Request request;
+            Response response;
+            if (!parse_request(head, request)) {
+                response = Response(400, "bad request\n", "text/plain");
+                request.keep_alive = false;
+            }
+            else if (request.method != "GET") {
+                response = Response(405, "method not allowed\n", "text/plain");
+                request.keep_alive = false;
+            }
+            else {
+                try { response = handler(request); }
+                catch (std::exception &e) {
+                    response = Response(500, std::string(e.what()) + "\n", "text/plain");
+                }
+            }
+
+            append_response(conn, response, request.keep_alive);
+            if (!request.keep_alive) conn.close_after = true;
+        }
+
+        if (!blocked && !conn.close_after && conn.in.size() > MAX_REQUEST_SIZE) {
+            append_response(conn, Response(431, "request too large\n", "text/plain"), false);
+            conn.close_after = true;
+        }
+        if (!blocked && conn.peer_closed) conn.close_after = true;
+        if (conn.close_after) conn.in.clear();
+        return blocked;
+    }
+
+    static void append_response(Connection &conn, const Response &response, bool keep_alive) {
+        std::string &out = conn.out;
+        out += "HTTP/1.1 " + to_string(response.status) + " " + reason(response.status) + "\r\n";
+        out += "Content-Type: " + response.content_type + "\r\n";
+        out += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+        out += "Access-Control-Allow-Origin: *\r\n";
+        out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        out += response.body;
+    }
+
+    /**
+     * Sends the pending output, returns true if all of it was sent and the
+     * connection stays open. While blocked or closing, no more input is
+     * read until then.
+     */
+    bool flush(int fd, bool blocked) {
+        Connection &conn = connections[fd];
+
+        while (conn.out_pos < conn.out.size()) {
+            ssize_t n = send(fd, conn.out.data() + conn.out_pos,
+                conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.out_pos += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                watch(fd, conn.close_after || blocked ? EPOLLOUT : EPOLLIN | EPOLLOUT,
+                    EPOLL_CTL_MOD);
+                conn.waiting_output = true;
+                return false;
+            }
+            drop(fd);
+            return false;
+        }
+
+        conn.out.clear();
+        conn.out_pos = 0;
+        if (conn.close_after) {
+            drop(fd);
+            return false;
+        }
+        if (conn.waiting_output) {
+            watch(fd, EPOLLIN, EPOLL_CTL_MOD);
+            conn.waiting_output = false;
+        }
+        return true;
+    }
+
+    static const char *reason(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Internal Server Error";
+        }
+    }
+
+    static std::string lower(std::string str) {
+        for (size_t i = 0; i < str.size(); ++i)
+            if (str[i] >= 'A' && str[i] <= 'Z') str[i] += 'a' - 'A';
+        return str;
+    }
+};
+
+#endif
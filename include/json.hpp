@@ -1,193 +1,296 @@
 #ifndef __JSON_HPP
 #define __JSON_HPP
 
+#include <cstdio>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <memory>
 #include <stack>
-#include <iomanip>
+#include <stdexcept>
 
-class JsonWriter {
+struct JsonTokens {
+    enum Token { NONE, OPENING, KEY, VALUE, CLOSING };
+};
+
+/**
+ * Validation policy of BasicJsonWriter that checks the grammar of every
+ * token and throws on misplaced keys, values and brackets.
+ */
+class CheckedJson : public JsonTokens {
 public:
     typedef std::runtime_error error;
 
-    JsonWriter(std::ostream &out) : os(out) { init_state(); }
-    JsonWriter(std::string filename) :
-        p_file(new std::ofstream(filename.c_str())),
-        os(*p_file.get())
-    { init_state(); }
-    
-    JsonWriter() :
-        p_stringstream(new std::ostringstream()),
-        os(*p_stringstream.get())
-    { init_state(); }
-    
-    JsonWriter& begin(char opening_bracket) {
-        begin_token(OPENING);
-        
-        char closing_bracket;
-        if (opening_bracket == '{') closing_bracket = '}';
-        else if (opening_bracket == '[') closing_bracket = ']';
-        else throw error("invalid bracket");
-        
-        brackets.push(closing_bracket);
-        
-        os << opening_bracket;
-        return *this;
+    CheckedJson() : last_token(NONE) {}
+
+    static char closing_bracket(char opening_bracket) {
+        if (opening_bracket == '{') return '}';
+        if (opening_bracket == '[') return ']';
+        throw error("invalid bracket");
     }
-    
-    JsonWriter& end(char closing_bracket) {
-        begin_token(CLOSING);
-        
+
+    void open(char closing_bracket) { brackets.push(closing_bracket); }
+
+    void close(char closing_bracket) {
         if (brackets.top() != closing_bracket) throw error("unmatched bracket");
         brackets.pop();
-        
-        os << closing_bracket;
         last_token = VALUE;
+    }
+
+    /** Returns true if a comma must precede the token */
+    bool begin_token(Token token) {
+
+        if (brackets.empty()) {
+            if (last_token != NONE) throw error("cannot re-open final bracket");
+            if (token == OPENING || token == VALUE) {
+                last_token = token;
+                return false;
+            }
+            else throw error("unexpected token");
+        }
+
+        if (token == KEY) {
+            if (brackets.top() != '}' || last_token == KEY)
+                throw error("unexpected key");
+        }
+        else {
+            if (token == CLOSING) {
+                if (brackets.empty()) throw error("bracket not open");
+            }
+            else {
+                if (brackets.top() == '}' && last_token != KEY)
+                    throw error("expected key");
+            }
+        }
+
+        const bool comma = token != CLOSING && last_token != OPENING && last_token != KEY;
+        last_token = token;
+        return comma;
+    }
+
+private:
+    Token last_token;
+    std::stack<char> brackets;
+};
+
+/**
+ * Validation policy of BasicJsonWriter that trusts the caller and only
+ * tracks where commas go. Misuse produces invalid JSON instead of errors.
+ */
+class UncheckedJson : public JsonTokens {
+public:
+    UncheckedJson() : last_token(NONE) {}
+
+    static char closing_bracket(char opening_bracket) {
+        return opening_bracket == '{' ? '}' : ']';
+    }
+
+    void open(char) {}
+    void close(char) { last_token = VALUE; }
+
+    bool begin_token(Token token) {
+        const bool comma = token != CLOSING && last_token == VALUE;
+        last_token = token;
+        return comma;
+    }
+
+private:
+    Token last_token;
+};
+
+/** Output buffer of BasicJsonWriter that collects the document in a string */
+class JsonStringBuffer {
+public:
+    void put(char c) { str.push_back(c); }
+    void write(const char *s, size_t n) { str.append(s, n); }
+    const std::string &to_string() const { return str; }
+
+private:
+    std::string str;
+};
+
+/** Output buffer of BasicJsonWriter that only counts the bytes */
+class JsonSizeBuffer {
+public:
+    JsonSizeBuffer() : n_bytes(0) {}
+
+    void put(char) { n_bytes++; }
+    void write(const char *, size_t n) { n_bytes += n; }
+    size_t size() const { return n_bytes; }
+
+private:
+    size_t n_bytes;
+};
+
+/** Output buffer of BasicJsonWriter that writes to a stream or a file */
+class JsonStreamBuffer {
+public:
+    JsonStreamBuffer(std::ostream &out) : os(out) {}
+    JsonStreamBuffer(std::string filename) :
+        p_file(new std::ofstream(filename.c_str())),
+        os(*p_file)
+    {}
+
+    void put(char c) { os.put(c); }
+    void write(const char *s, size_t n) { os.write(s, n); }
+
+private:
+    const std::unique_ptr<std::ofstream> p_file;
+    std::ostream &os;
+};
+
+/**
+ * Writes JSON token by token. The Validation policy (CheckedJson or
+ * UncheckedJson) decides whether the grammar is checked and the Buffer
+ * (JsonStringBuffer or JsonStreamBuffer) where the output goes, so that
+ * the unchecked string writer compiles down to plain appends.
+ */
+template <class Validation, class Buffer>
+class BasicJsonWriter {
+public:
+    typedef std::runtime_error error;
+    typedef JsonTokens::Token Token;
+
+    BasicJsonWriter() {}
+    BasicJsonWriter(std::ostream &out) : buffer(out) {}
+    BasicJsonWriter(std::string filename) : buffer(filename) {}
+
+    BasicJsonWriter& begin(char opening_bracket) {
+        begin_token(JsonTokens::OPENING);
+        validation.open(Validation::closing_bracket(opening_bracket));
+        buffer.put(opening_bracket);
+        return *this;
+    }
+
+    BasicJsonWriter& end(char closing_bracket) {
+        begin_token(JsonTokens::CLOSING);
+        validation.close(closing_bracket);
+        buffer.put(closing_bracket);
         return *this;
     }
-    
-    JsonWriter& key(const char *key) {
-        begin_token(KEY);
+
+    BasicJsonWriter& key(const char *key) {
+        begin_token(JsonTokens::KEY);
         write_string(key);
-        os << ':';
+        buffer.put(':');
         return *this;
     }
-    
-    JsonWriter& value(const char *str) {
-        begin_token(VALUE);
+
+    BasicJsonWriter& value(const char *str) {
+        begin_token(JsonTokens::VALUE);
         write_string(str);
         return *this;
     }
-    
-    JsonWriter& null_value() {
-        begin_token(VALUE);
-        os << "null";
+
+    BasicJsonWriter& null_value() {
+        begin_token(JsonTokens::VALUE);
+        buffer.write("null", 4);
         return *this;
     }
-    
-    JsonWriter& value(int n) {
-        begin_token(VALUE);
-        os << n;
+
+    BasicJsonWriter& value(int n) { return value((long long)n); }
+
+    BasicJsonWriter& value(long long n) {
+        begin_token(JsonTokens::VALUE);
+        char digits[24];
+        char *p = digits + sizeof(digits);
+        unsigned long long u = n < 0 ? 0ULL - (unsigned long long)n : n;
+        do {
+            *--p = '0' + u % 10;
+            u /= 10;
+        } while (u > 0);
+        if (n < 0) *--p = '-';
+        buffer.write(p, digits + sizeof(digits) - p);
         return *this;
     }
-    
-    JsonWriter& value(double n) {
-        begin_token(VALUE);
-        os << n;
+
+    BasicJsonWriter& value(double n) {
+        begin_token(JsonTokens::VALUE);
+        // same as the default std::ostream formatting
+        char str[32];
+        buffer.write(str, snprintf(str, sizeof(str), "%g", n));
         return *this;
     }
-    
-    JsonWriter& value(bool t) {
-        begin_token(VALUE);
-        if (t) os << "true";
-        else os << "false";
+
+    BasicJsonWriter& value(bool t) {
+        begin_token(JsonTokens::VALUE);
+        if (t) buffer.write("true", 4);
+        else buffer.write("false", 5);
         return *this;
     }
-    
-    template <class T> JsonWriter& value(const T& t) {
+
+    template <class T> BasicJsonWriter& value(const T& t) {
         t.write_json(*this);
         return *this;
     }
-    
+
     // string aliases
-    JsonWriter& key(std::string s) { return key(s.c_str()); }
-    JsonWriter& value(std::string s) { return value(s.c_str()); }
-    JsonWriter& begin(const char *c) { return begin(only_char(c)); }
-    JsonWriter& end(const char *c) { return end(only_char(c));  }
-    
-    size_t bytes_written() { return file().tellp(); }
-    std::string to_string() { return stringstream().str(); }
-    
+    BasicJsonWriter& key(const std::string &s) { return key(s.c_str()); }
+    BasicJsonWriter& value(const std::string &s) { return value(s.c_str()); }
+    BasicJsonWriter& begin(const char *c) { return begin(only_char(c)); }
+    BasicJsonWriter& end(const char *c) { return end(only_char(c));  }
+
+    std::string to_string() const { return buffer.to_string(); }
+    size_t size() const { return buffer.size(); }
+
 private:
-    const std::auto_ptr<std::ofstream> p_file;
-    const std::auto_ptr<std::ostringstream> p_stringstream;
-    std::ostream &os;
-    
-    void init_state() { last_token = NONE; }
-    
-    std::ostringstream& stringstream() {
-        if (p_stringstream.get() == NULL) throw error("not a stringstream");
-        return *p_stringstream.get();
-    }
-    
-    std::ofstream& file() {
-        if (p_file.get() == NULL) throw error("not a file");
-        return *p_file.get();
-    }
-    
-    enum Token { NONE, OPENING, KEY, VALUE, CLOSING } last_token;
-    
-    std::stack<char> brackets;
-    
+    Validation validation;
+    Buffer buffer;
+
+    void begin_token(Token token) {
+        if (validation.begin_token(token)) buffer.put(',');
+    }
+
     char only_char(const char *str) {
         if (str[0] == '\0' || str[1] != '\0') throw error("multi-char bracket");
         return str[0];
     }
-    
+
     void write_string(const char *str) {
-        os << '"';
-        while(*str != '\0') {
-            char c = *str;
+        buffer.put('"');
+        const char *run = str;
+        for (; *str != '\0'; str++) {
+            const char c = *str;
+            const char *escaped;
             switch (c) {
-            case '"': os << "\\\""; break;
-            case '/': os << "\\/"; break; // prevents "</script>"
-            case '\\': os << "\\\\"; break;
-            case '\n': os << "\\n"; break;
-            case '\r': os << "\\r"; break;
-            case '\t': os << "\\t"; break;
-            case '\f': os << "\\f"; break;
+            case '"': escaped = "\\\""; break;
+            case '/': escaped = "\\/"; break; // prevents "</script>"
+            case '\\': escaped = "\\\\"; break;
+            case '\n': escaped = "\\n"; break;
+            case '\r': escaped = "\\r"; break;
+            case '\t': escaped = "\\t"; break;
+            case '\f': escaped = "\\f"; break;
             default:
-                if (unsigned(c) <= 0x1f) {
-                    // C++-style fprintf("%04x", x) <3
-                    std::ios::fmtflags f( os.flags() );
-                    os << "\\u"
-                       << std::setfill('0') << std::setw(4) 
-                       << std::hex
-                       << int(c);
-                    os.flags(f);
-                }
-                else os << c;
+                if (unsigned(c) > 0x1f) continue;
+                escaped = NULL;
                 break;
             }
-            str++;
-        }
-        os << '"';
-    }
-    
-    void begin_token(Token token) {
-        
-        if (brackets.empty()) {
-            if (last_token != NONE) throw error("cannot re-open final bracket");
-            if (token == OPENING || token == VALUE) {
-                last_token = token;
-                return;
-            }
-            else throw error("unexpected token");
-        }
-        
-        if (token == KEY) {
-            if (brackets.top() != '}' || last_token == KEY)
-                throw error("unexpected key");
-        }
-        else {
-            if (token == CLOSING) {
-                if (brackets.empty()) throw error("bracket not open");
-            }
+            buffer.write(run, str - run);
+            run = str + 1;
+
+            if (escaped != NULL) buffer.write(escaped, 2);
             else {
-                if (brackets.top() == '}' && last_token != KEY)
-                    throw error("expected key");
+                char code[8];
+                buffer.write(code, snprintf(code, sizeof(code), "\\u%04x", int(c)));
             }
         }
-        
-        if (token != CLOSING && last_token != OPENING && last_token != KEY) {
-            os << ',';
-        }
-        last_token = token;
+        buffer.write(run, str - run);
+        buffer.put('"');
     }
 };
 
+/** Checks the grammar of the output, for tests and hand-written documents */
+typedef BasicJsonWriter<CheckedJson, JsonStringBuffer> CheckedJsonWriter;
+
+/** The writer of the generated documents */
+typedef BasicJsonWriter<UncheckedJson, JsonStringBuffer> JsonWriter;
+
+/** Measures a document without formatting it into memory */
+typedef BasicJsonWriter<UncheckedJson, JsonSizeBuffer> JsonSizeWriter;
+
+/** Writes to a stream or a file, e.g., the bench and load test reports */
+typedef BasicJsonWriter<CheckedJson, JsonStreamBuffer> JsonStreamWriter;
+
 // this is what I hate about C++
 template <class T> std::string to_string(T x) {
     std::ostringstream oss; oss << x; return oss.str();
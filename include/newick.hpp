@@ -0,0 +1,295 @@
+#ifndef __NEWICK_HPP
+#define __NEWICK_HPP
+
+#include <cstdio>
+#include <istream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NEWICK_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Structural index of Newick text: the positions of the quotes and of the
+ * '(', ')', ',' and ';' characters outside quoted names, in order.
+ *
+ * The text is scanned in blocks of 64 bytes. Each block gives bitmasks of
+ * the quotes and the delimiters, the quoted parts are the prefix XOR of
+ * the quote mask (a doubled quote inside a name toggles twice around an
+ * empty range) and the remaining bits are collected with count-trailing-
+ * zeros. The masks are computed with AVX2, SSE2 or a scalar loop, chosen
+ * at runtime.
+ */
+class NewickIndex {
+public:
+    typedef std::runtime_error error;
+    enum Kernel { SCALAR, SSE2, AVX2 };
+
+    NewickIndex(const char *data, size_t size, Kernel kernel = best_kernel()) {
+        if (size >= (size_t(1) << 32)) throw error("Newick input over 4 GB");
+        if (!supported(kernel)) throw error(std::string(kernel_name(kernel)) + " not supported");
+
+        positions.resize(size / 8 + 64);
+        size_t n = 0;
+        switch (kernel) {
+#ifdef NEWICK_X86
+        case AVX2: n = scan_avx2(data, size); break;
+        case SSE2: n = scan_sse2(data, size); break;
+#endif
+        default: n = scan_scalar(data, size); break;
+        }
+        positions.resize(n);
+    }
+
+    size_t size() const { return positions.size(); }
+    uint32_t operator[](size_t i) const { return positions[i]; }
+
+    static bool supported(Kernel kernel) {
+        if (kernel == SCALAR) return true;
+#ifdef NEWICK_X86
+        __builtin_cpu_init();
+        if (kernel == SSE2) return __builtin_cpu_supports("sse2");
+        if (kernel == AVX2) return __builtin_cpu_supports("avx2");
+#endif
+        return false;
+    }
+
+    static Kernel best_kernel() {
+        if (supported(AVX2)) return AVX2;
+        if (supported(SSE2)) return SSE2;
+        return SCALAR;
+    }
+
+    static const char *kernel_name(Kernel kernel) {
+        switch (kernel) {
+        case AVX2: return "avx2";
+        case SSE2: return "sse2";
+        default: return "scalar";
+        }
+    }
+
+private:
+    static const size_t BLOCK = 64;
+
+    std::vector<uint32_t> positions;
+
+    static uint64_t prefix_xor(uint64_t bits) {
+        bits ^= bits << 1;
+        bits ^= bits << 2;
+        bits ^= bits << 4;
+        bits ^= bits << 8;
+        bits ^= bits << 16;
+        bits ^= bits << 32;
+        return bits;
+    }
+
+    /** The indexed bits of a block, in_quote carries the quote state across blocks */
+    static uint64_t structural_bits(uint64_t quotes, uint64_t delimiters, uint64_t &in_quote) {
+        const uint64_t quoted = prefix_xor(quotes) ^ in_quote;
+        in_quote = uint64_t(int64_t(quoted) >> 63);
+        return (delimiters & ~quoted) | quotes;
+    }
+
+    /** Appends the positions of the bits, returns the new count */
+    size_t flatten(uint32_t base, uint64_t bits, size_t n) {
+        if (n + BLOCK > positions.size()) positions.resize(positions.size() * 2 + BLOCK);
+        uint32_t *out = &positions[0];
+        while (bits != 0) {
+            out[n++] = base + __builtin_ctzll(bits);
+            bits &= bits - 1;
+        }
+        return n;
+    }
+
+    /** The last partial block, padded with spaces */
+    static const char *tail(const char *data, size_t size, size_t begin, char *buffer) {
+        memset(buffer, ' ', BLOCK);
+        memcpy(buffer, data + begin, size - begin);
+        return buffer;
+    }
+
+    static uint64_t scalar_masks(const char *p, uint64_t &quotes) {
+        uint64_t delimiters = 0;
+        quotes = 0;
+        for (size_t i = 0; i < BLOCK; ++i) {
+            const char c = p[i];
+            if (c == '(' || c == ')' || c == ',' || c == ';') delimiters |= uint64_t(1) << i;
+            else if (c == '\'') quotes |= uint64_t(1) << i;
+        }
+        return delimiters;
+    }
+
+    size_t scan_scalar(const char *data, size_t size) {
+        uint64_t in_quote = 0, quotes;
+        size_t n = 0;
+        char buffer[BLOCK];
+        for (size_t begin = 0; begin < size; begin += BLOCK) {
+            const char *p = begin + BLOCK <= size ? data + begin : tail(data, size, begin, buffer);
+            const uint64_t delimiters = scalar_masks(p, quotes);
+            n = flatten(begin, structural_bits(quotes, delimiters, in_quote), n);
+        }
+        return n;
+    }
+
+#ifdef NEWICK_X86
+    __attribute__((target("sse2")))
+    static uint64_t sse2_masks(const char *p, uint64_t &quotes) {
+        uint64_t delimiters = 0;
+        quotes = 0;
+        for (int i = 0; i < 4; ++i) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(p + 16*i));
+            const __m128i d = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')), _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')), _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))));
+            delimiters |= uint64_t(uint16_t(_mm_movemask_epi8(d))) << (16*i);
+            quotes |= uint64_t(uint16_t(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))))) << (16*i);
+        }
+        return delimiters;
+    }
+
+    __attribute__((target("sse2")))
+    size_t scan_sse2(const char *data, size_t size) {
+        uint64_t in_quote = 0, quotes;
+        size_t n = 0;
+        char buffer[BLOCK];
+        for (size_t begin = 0; begin < size; begin += BLOCK) {
+            const char *p = begin + BLOCK <= size ? data + begin : tail(data, size, begin, buffer);
+            const uint64_t delimiters = sse2_masks(p, quotes);
+            n = flatten(begin, structural_bits(quotes, delimiters, in_quote), n);
+        }
+        return n;
+    }
+
+    __attribute__((target("avx2")))
+    static uint64_t avx2_masks(const char *p, uint64_t &quotes) {
+        uint64_t delimiters = 0;
+        quotes = 0;
+        for (int i = 0; i < 2; ++i) {
+            const __m256i v = _mm256_loadu_si256((const __m256i*)(p + 32*i));
+            const __m256i d = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';'))));
+            delimiters |= uint64_t(uint32_t(_mm256_movemask_epi8(d))) << (32*i);
+            quotes |= uint64_t(uint32_t(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))))) << (32*i);
+        }
+        return delimiters;
+    }
+
+    __attribute__((target("avx2")))
+    size_t scan_avx2(const char *data, size_t size) {
+        uint64_t in_quote = 0, quotes;
+        size_t n = 0;
+        char buffer[BLOCK];
+        for (size_t begin = 0; begin < size; begin += BLOCK) {
+            const char *p = begin + BLOCK <= size ? data + begin : tail(data, size, begin, buffer);
+            const uint64_t delimiters = avx2_masks(p, quotes);
+            n = flatten(begin, structural_bits(quotes, delimiters, in_quote), n);
+        }
+        return n;
+    }
+#endif
+};
+
+/**
+ * Reads the tokens and names of Newick text through its NewickIndex, so
+ * that names are sliced between two indexed positions instead of being
+ * read character by character.
+ */
+class NewickReader {
+public:
+    typedef std::runtime_error error;
+
+    NewickReader(const char *data_, size_t size_,
+                 NewickIndex::Kernel kernel = NewickIndex::best_kernel()) :
+        data(data_), size(size_), index(data_, size_, kernel), pos(0), next(0)
+    {}
+
+    /** The character at the read position, EOF at the end */
+    int peek() const { return pos < size ? data[pos] : EOF; }
+
+    /** Reads a delimiter, i.e., an indexed character */
+    int get() {
+        const int c = peek();
+        if (pos < size) {
+            pos++;
+            next++;
+        }
+        return c;
+    }
+
+    /** Reads a name up to the next ',', ')' or ';' */
+    std::string read_name() {
+        if (peek() == '\'') return read_quoted_name();
+
+        const size_t begin = pos;
+        size_t end = size;
+        for (; next < index.size(); ++next) {
+            const size_t p = index[next];
+            if (data[p] == '(') continue;
+            if (data[p] == '\'') throw error("unexpected quote after "+unescape(begin, p));
+            end = p;
+            break;
+        }
+        pos = end;
+        return unescape(begin, end);
+    }
+
+    static std::string read_stream(std::istream &is) {
+        std::string str;
+        char buffer[1 << 16];
+        while (is.read(buffer, sizeof(buffer)) || is.gcount() > 0)
+            str.append(buffer, is.gcount());
+        return str;
+    }
+
+private:
+    const char *data;
+    const size_t size;
+    const NewickIndex index;
+    // read position in data and the first index entry at or after it
+    size_t pos, next;
+
+    std::string read_quoted_name() {
+        get();
+        std::string name;
+        while (next < index.size()) {
+            // only quotes are indexed inside quoted names
+            const size_t quote = index[next];
+            name += unescape(pos, quote);
+            pos = quote + 1;
+            next++;
+            if (pos < size && data[pos] == '\'') {
+                name += '\'';
+                get();
+                continue;
+            }
+            const int c = peek();
+            if (c != ',' && c != ')' && c != ';' && c != EOF)
+                throw error("expected quote after "+name);
+            return name;
+        }
+        // unterminated quote
+        name += unescape(pos, size);
+        pos = size;
+        return name;
+    }
+
+    /** Underscores stand for spaces */
+    std::string unescape(size_t begin, size_t end) const {
+        std::string str(data + begin, end - begin);
+        for (size_t i = 0; i < str.size(); ++i)
+            if (str[i] == '_') str[i] = ' ';
+        return str;
+    }
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __OUTPUT_HPP
+#define __OUTPUT_HPP
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <json.hpp>
+
+inline std::ostream &format_bytes(std::ostream &os, size_t bytes) {
+    os  << (bytes / 1024) << " kB";
+    return os;
+}
+
+/**
+ * Destination of the generated JSON documents. Documents are identified by
+ * a base name such as "subtree-3". Implementations must allow concurrent
+ * calls to write.
+ */
+class OutputSink {
+public:
+    typedef std::runtime_error error;
+
+    virtual ~OutputSink() {}
+    virtual void write(const std::string &name, const std::string &payload) = 0;
+    /** Called once after all documents have been written */
+    virtual void finish() {}
+};
+
+/** Writes each document to the file <prefix><name>.json */
+class DirectorySink : public OutputSink {
+public:
+    DirectorySink(std::string prefix_) : prefix(prefix_) {}
+
+    void write(const std::string &name, const std::string &payload) {
+        std::string filename = path(name);
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write(payload.data(), payload.size());
+        if (!out) throw error("could not write "+filename);
+    }
+
+    std::string path(const std::string &name) const {
+        return prefix + name + ".json";
+    }
+
+private:
+    const std::string prefix;
+};
+
+/** Keeps the documents in memory, for tests */
+class MemorySink : public OutputSink {
+public:
+    std::map<std::string, std::string> documents;
+
+    void write(const std::string &name, const std::string &payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        documents[name] = payload;
+    }
+
+private:
+    std::mutex mutex;
+};
+
+/** Only records the size of each document, e.g., to simulate a run */
+class SizeSink : public OutputSink {
+public:
+    std::map<std::string, size_t> sizes;
+
+    void write(const std::string &name, const std::string &payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sizes[name] = payload.size();
+    }
+
+private:
+    std::mutex mutex;
+};
+
+/** Returns the size of the document */
+template <class Tree>
+size_t write_json_tree(const Tree& tree, std::string name, OutputSink &out, std::ostream &log,
+                       int schema = 1) {
+    log << "writing tree " << name <<  "\t";
+    JsonWriter json;
+    tree.write_json(json, schema);
+    const std::string payload = json.to_string();
+    out.write(name, payload);
+    format_bytes(log, payload.size()) << std::endl;
+    return payload.size();
+}
+
+#endif
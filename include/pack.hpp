@@ -0,0 +1,149 @@
+#ifndef __PACK_HPP
+#define __PACK_HPP
+
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+#include <output.hpp>
+
+/**
+ * Appends all documents to a single file <prefix>.pack and, on finish,
+ * writes the index <prefix>-index.json that maps each document name to
+ * its [offset, length] in bytes. Clients can then fetch any document with
+ * an HTTP Range request and deploying the data is one sequential copy.
+ */
+class PackSink : public OutputSink {
+public:
+    PackSink(std::string prefix_) :
+        prefix(prefix_),
+        out(pack_file(prefix_).c_str(), std::ios::binary),
+        offset(0)
+    {
+        if (!out) throw error("could not open "+pack_file(prefix));
+    }
+
+    void write(const std::string &name, const std::string &payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.count(name) > 0) throw error("duplicate pack entry "+name);
+
+        out.write(payload.data(), payload.size());
+        if (!out) throw error("could not write "+pack_file(prefix));
+
+        index[name] = Entry(offset, payload.size());
+        offset += payload.size();
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        out.flush();
+        if (!out) throw error("could not write "+pack_file(prefix));
+
+        std::ofstream index_out(index_file(prefix).c_str());
+        JsonStreamWriter json(index_out);
+        json.begin('{');
+        for (std::map<std::string, Entry>::const_iterator itr = index.begin();
+            itr != index.end(); ++itr)
+            json.key(itr->first)
+                .begin('[')
+                    .value((long long)itr->second.first)
+                    .value((long long)itr->second.second)
+                .end(']');
+        json.end('}');
+
+        index_out.flush();
+        if (!index_out) throw error("could not write "+index_file(prefix));
+    }
+
+    static std::string pack_file(const std::string &prefix) { return prefix + ".pack"; }
+    static std::string index_file(const std::string &prefix) { return prefix + "-index.json"; }
+
+private:
+    typedef std::pair<unsigned long long, unsigned long long> Entry;
+
+    const std::string prefix;
+    std::ofstream out;
+    unsigned long long offset;
+    std::map<std::string, Entry> index;
+    std::mutex mutex;
+};
+
+/** Reads documents written by PackSink */
+class PackReader {
+public:
+    typedef std::runtime_error error;
+
+    PackReader(std::string prefix) :
+        in(PackSink::pack_file(prefix).c_str(), std::ios::binary)
+    {
+        if (!in) throw error("could not open "+PackSink::pack_file(prefix));
+
+        std::ifstream index_in(PackSink::index_file(prefix).c_str());
+        if (!index_in) throw error("could not open "+PackSink::index_file(prefix));
+        std::ostringstream oss;
+        oss << index_in.rdbuf();
+        parse_index(oss.str());
+    }
+
+    std::vector<std::string> names() const {
+        std::vector<std::string> result;
+        for (std::map<std::string, Entry>::const_iterator itr = index.begin();
+            itr != index.end(); ++itr)
+            result.push_back(itr->first);
+        return result;
+    }
+
+    bool contains(const std::string &name) const { return index.count(name) > 0; }
+
+    std::string read(const std::string &name) {
+        std::map<std::string, Entry>::const_iterator itr = index.find(name);
+        if (itr == index.end()) throw error("no pack entry "+name);
+
+        std::string payload(itr->second.second, '\0');
+        in.seekg(itr->second.first);
+        in.read(&payload[0], payload.size());
+        if (!in) throw error("truncated pack entry "+name);
+        return payload;
+    }
+
+private:
+    typedef std::pair<unsigned long long, unsigned long long> Entry;
+
+    std::ifstream in;
+    std::map<std::string, Entry> index;
+
+    /** Parses {"name":[offset,length],...}, names are never escaped */
+    void parse_index(const std::string &json) {
+        size_t pos = json.find('{');
+        if (pos == std::string::npos) throw error("invalid pack index");
+
+        while (true) {
+            size_t key_begin = json.find_first_of("\"}", pos + 1);
+            if (key_begin == std::string::npos) throw error("invalid pack index");
+            if (json[key_begin] == '}') return;
+
+            size_t key_end = json.find('"', key_begin + 1);
+            if (key_end == std::string::npos ||
+                json.compare(key_end + 1, 2, ":[") != 0)
+                throw error("invalid pack index");
+
+            const char *p = json.c_str() + key_end + 3;
+            char *end;
+            Entry entry;
+            entry.first = strtoull(p, &end, 10);
+            if (*end != ',') throw error("invalid pack index");
+            entry.second = strtoull(end + 1, &end, 10);
+            if (*end != ']') throw error("invalid pack index");
+
+            index[json.substr(key_begin + 1, key_end - key_begin - 1)] = entry;
+            pos = end - json.c_str();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __PARALLEL_HPP
+#define __PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Number of worker threads to use if not specified by the user */
+inline int default_thread_count() {
+    int n = std::thread::hardware_concurrency();
+    if (n < 1) n = 1;
+    return n;
+}
+
+/**
+ * Runs fn(thread_index) for thread_index = 0..n_threads-1, each in its own
+ * thread, and waits for all of them. The first exception thrown by any of
+ * the workers is re-thrown in the calling thread.
+ */
+template <class Function>
+void run_parallel(int n_threads, Function fn) {
+    if (n_threads <= 1) {
+        fn(0);
+        return;
+    }
+
+    std::vector<std::exception_ptr> errors(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < n_threads; ++i) {
+        threads.push_back(std::thread([&fn, &errors, i]() {
+            try { fn(i); }
+            catch (...) { errors[i] = std::current_exception(); }
+        }));
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+    for (size_t i = 0; i < errors.size(); ++i)
+        if (errors[i]) std::rethrow_exception(errors[i]);
+}
+
+/**
+ * Runs tasks that may spawn more tasks on n_threads workers: the thread
+ * that calls run() and a pool of n_threads - 1 threads that lives as long
+ * as the scheduler, so that it can be run many times at the cost of one
+ * thread start each. Each worker takes the newest task of its own deque
+ * and, when that is empty, steals the oldest one of another worker, so
+ * that large jobs get split across the workers while each of them mostly
+ * works depth-first. Idle workers sleep until a task is spawned. The
+ * first exception thrown by a task is re-thrown by run() once all tasks
+ * are done.
+ */
+class WorkStealingScheduler {
+public:
+    /** A task gets the index of the worker that runs it */
+    typedef std::function<void(int)> Task;
+
+    explicit WorkStealingScheduler(int n_threads_) :
+        n_threads(std::max(1, n_threads_)), queues(n_threads), pending(0), n_steals(0),
+        n_spawned(0), stopping(false)
+    {
+        for (int i = 1; i < n_threads; ++i)
+            pool.push_back(std::thread(&WorkStealingScheduler::work, this, i));
+    }
+
+    ~WorkStealingScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+    }
+
+    /**
+     * Adds a task before run(), or from a task running on the given worker.
+     * The pool may start on it right away.
+     */
+    void spawn(Task task, int worker = 0) {
+        pending++;
+        {
+            Queue &queue = queues[worker];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        if (n_threads == 1) return;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            n_spawned++;
+        }
+        wake.notify_one();
+    }
+
+    /** Runs the tasks, and the tasks they spawn, until none are left */
+    void run() {
+        Task task;
+        while (pending > 0) {
+            const unsigned long seen = spawned();
+            if (take(0, task)) {
+                execute(task, 0);
+                continue;
+            }
+            // the rest is running in the pool, wait for it to finish or spawn
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            while (pending > 0 && n_spawned == seen) wake.wait(lock);
+        }
+
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (error) {
+            std::exception_ptr e = error;
+            error = std::exception_ptr();
+            std::rethrow_exception(e);
+        }
+    }
+
+    int threads() const { return n_threads; }
+
+    /** The tasks taken from another worker so far */
+    long steals() const { return n_steals; }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    const int n_threads;
+    std::vector<Queue> queues;
+    // spawned and not finished, so run() waits while other tasks may still
+    // spawn more
+    std::atomic<long> pending;
+    std::atomic<long> n_steals;
+
+    std::vector<std::thread> pool;
+    // the workers without a task sleep until n_spawned changes
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    unsigned long n_spawned;
+    bool stopping;
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    unsigned long spawned() {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        return n_spawned;
+    }
+
+    /** The loop of the pool thread of the given worker */
+    void work(int worker) {
+        Task task;
+        while (true) {
+            const unsigned long seen = spawned();
+            if (take(worker, task)) {
+                execute(task, worker);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            while (!stopping && n_spawned == seen) wake.wait(lock);
+            if (stopping) return;
+        }
+    }
+
+    void execute(Task &task, int worker) {
+        try { task(worker); }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) error = std::current_exception();
+        }
+        task = Task();
+        if (--pending == 0) {
+            // wake run()
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            wake.notify_all();
+        }
+    }
+
+    bool take(int worker, Task &task) { return pop(worker, task) || steal(worker, task); }
+
+    bool pop(int worker, Task &task) {
+        Queue &queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int worker, Task &task) {
+        for (int i = 1; i < n_threads; ++i) {
+            Queue &queue = queues[(worker + i) % n_threads];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            n_steals++;
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,566 @@
+#ifndef __SEARCH_HPP
+#define __SEARCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <assert.h>
+
+#include <bloom.hpp>
+#include <json.hpp>
+#include <output.hpp>
+#include <parallel.hpp>
+#include <snapshot.hpp>
+#include <tree.hpp>
+#include <trie.hpp>
+#include <utf8.hpp>
+
+/**
+ * A prefix tree of the taxon names. The names are sharded by their first
+ * character: each shard is inserted to its own char trie and compressed
+ * independently, possibly in parallel, and the results are then merged
+ * under a common root. Duplicate names are disambiguated in the order of
+ * the traverse_tree calls and, within one, of the node ids, i.e., of the
+ * source file: the first keeps the plain name and the others get
+ * " (ext_id)" appended. Since this only compares names with the same first
+ * character, the result is identical to inserting the names one by one
+ * into a single trie in that order, and it does not depend on the order of
+ * the children.
+ *
+ * If top_k > 0, the trie nodes with more than top_k names below them list
+ * the top_k names with the most leaves as "t": [[suffix, id, subtree], ...],
+ * so that completions of a prefix need no further shard fetches. The names
+ * below the other nodes are in the same shard, and their values have the
+ * number of leaves as the third element, [id, subtree, leaves], if it is
+ * more than one.
+ */
+class SearchTree {
+public:
+    /** Sizes of the subtree documents that decompose_and_write_jsons splits off */
+    struct SubtreeParams {
+        // in nodes of the compressed trie
+        int max_subtree_size, min_subtree_size;
+        // the Bloom filter of the prefixes in each subtree takes at most
+        // this many bytes (0 for none) and about this many bits per prefix
+        int filter_bytes;
+        double filter_bits_per_prefix;
+        
+        SubtreeParams() :
+            max_subtree_size(120000), min_subtree_size(2000),
+            filter_bytes(2048), filter_bits_per_prefix(10)
+        {}
+    };
+
+    SearchTree(std::string json_name_prefix, OutputSink &out_, std::ostream &log_,
+        int n_threads_ = default_thread_count(), size_t top_k_ = 0,
+        const SubtreeParams &subtree_params_ = SubtreeParams()) :
+        out(out_),
+        log(log_),
+        json_prefix(json_name_prefix),
+        n_threads(n_threads_),
+        top_k(top_k_),
+        subtree_params(subtree_params_),
+        n_traversals(0),
+        n_redundant_visits(0)
+    {}
+
+    /**
+     * Adds the names in the given subtree. The subtrees may overlap: a node
+     * is owned by the first subtree it is seen in and later visits to it are
+     * skipped.
+     */
+    void traverse_tree(const TreeOfLife& tree, int subtree_id) {
+        add_names(tree, subtree_id);
+        n_traversals++;
+    }
+
+    /** The same for a subtree of TreeSnapshot::iterative_decomposition */
+    void traverse_tree(const TreeSnapshot::Subtree &tree, int subtree_id) {
+        const TreeSnapshot &snapshot = tree.snapshot();
+        auto add_name = [this, &snapshot, subtree_id](size_t i) {
+            const TreeSnapshot::Node &node = snapshot.node(i);
+            if (!mark_visited(node.id)) n_redundant_visits++;
+            else if (*snapshot.name(i) != '\0')
+                visit(snapshot.name(i), snapshot.ext_id(i), node.id, node.total_leaves, subtree_id);
+        };
+        tree.visit_nodes(add_name);
+        n_traversals++;
+    }
+
+    void compress() {
+        if (!compressed_trie.empty())
+            throw std::runtime_error("already compressed");
+
+        // distribute the shards to the threads, largest first
+        std::vector<ShardIterator> by_size;
+        for (ShardIterator itr = shards.begin(); itr != shards.end(); ++itr)
+            by_size.push_back(itr);
+        std::stable_sort(by_size.begin(), by_size.end(), larger_shard);
+
+        std::vector< std::vector<ShardIterator> > work(n_threads);
+        std::vector<size_t> load(n_threads, 0);
+        for (size_t i = 0; i < by_size.size(); ++i) {
+            int t = std::min_element(load.begin(), load.end()) - load.begin();
+            work[t].push_back(by_size[i]);
+            load[t] += by_size[i]->second.size();
+        }
+
+        std::vector< StringTrie<Pointer> > parts(n_threads);
+
+        run_parallel(n_threads, [&](int t) {
+            UnicodeTrie<Pointer> char_trie;
+            const std::vector<ShardIterator> &mine = work[t];
+
+            for (size_t i = 0; i < mine.size(); ++i) {
+                NameList &names = mine[i]->second;
+                std::sort(names.begin(), names.end(), serial_order);
+                for (size_t j = 0; j < names.size(); ++j)
+                    insert(char_trie, names[j]);
+            }
+
+            for (size_t i = 0; i < mine.size(); ++i) {
+                const Utf8::CodePoint &key = mine[i]->first;
+                parts[t].add_compressed_child(key, char_trie.children.find(key)->second);
+            }
+        });
+
+        // merge the compressed shards in the order of their first characters
+        typedef StringTrie<Pointer>::KeyValuePair KeyValuePair;
+        typedef std::pair<int, std::list<KeyValuePair>::iterator> Part;
+        std::map<Utf8::CodePoint, Part> merged;
+
+        for (int t = 0; t < n_threads; ++t) {
+            std::list<KeyValuePair>::iterator child = parts[t].children.begin();
+            for (size_t i = 0; i < work[t].size(); ++i, ++child)
+                merged[work[t][i]->first] = Part(t, child);
+        }
+
+        for (std::map<Utf8::CodePoint, Part>::iterator itr = merged.begin();
+            itr != merged.end(); ++itr) {
+
+            const Part &part = itr->second;
+            compressed_trie.children.splice(compressed_trie.children.end(),
+                parts[part.first].children, part.second);
+            compressed_trie.total_nodes += part.second->second.total_nodes;
+        }
+
+        shards.clear();
+
+        if (top_k > 0) {
+            std::string prefix;
+            size_t n_names = 0;
+            compute_completions(compressed_trie, prefix, n_names);
+        }
+    }
+
+    void decompose_and_write_jsons() const {
+        if (compressed_trie.empty()) throw std::runtime_error("not compressed");
+
+        std::vector<Subtree> subtrees;
+        {
+            JsonWriter root_json;
+            decomposed_write_json(compressed_trie, 0, root_json, subtrees);
+            const std::string payload = root_json.to_string();
+            out.write(json_prefix + "0", payload);
+
+            size_t filter_bytes = 0;
+            for (size_t i = 0; i < subtrees.size(); ++i) filter_bytes += subtrees[i].filter_bytes;
+            log << "writing tree " << json_prefix << "0\t";
+            format_bytes(log, payload.size()) << ", prefix filters ";
+            format_bytes(log, filter_bytes) << std::endl;
+        }
+
+        // the subtrees are formatted in parallel but passed to the output
+        // in order, which keeps pack files deterministic
+        std::atomic<size_t> next(0);
+        size_t next_output = 0;
+        bool failed = false;
+        std::mutex mutex;
+        std::condition_variable output_done;
+
+        run_parallel(n_threads, [&](int) {
+            try {
+                for (size_t i = next++; i < subtrees.size(); i = next++) {
+                    JsonWriter json;
+                    write_trie_json(*subtrees[i].trie, subtrees[i].prefix_length, json);
+                    const std::string payload = json.to_string();
+
+                    std::unique_lock<std::mutex> lock(mutex);
+                    while (next_output != i && !failed) output_done.wait(lock);
+                    if (failed) return;
+
+                    log << "writing tree " << subtrees[i].name << "\t";
+                    out.write(subtrees[i].name, payload);
+                    format_bytes(log, payload.size()) << std::endl;
+                    next_output++;
+                    output_done.notify_all();
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+                output_done.notify_all();
+                throw;
+            }
+        });
+    }
+
+    struct Pointer {
+        int id;
+        int subtree;
+        // the number of leaves below the node, ranks the completions
+        int weight;
+
+        template <class Writer> void write_json(Writer &json) const {
+            json.begin('[')
+                .value(id)
+                .value(subtree)
+                .end(']');
+        }
+    };
+
+    const StringTrie<Pointer> &trie() const { return compressed_trie; }
+    
+    /** Number of overlapping-subtree node visits that were skipped */
+    size_t redundant_visits() const { return n_redundant_visits; }
+
+private:
+    struct Name {
+        std::string name;
+        std::string ext_id;
+        Pointer value;
+        // the number of the traverse_tree call that added it
+        int traversal;
+    };
+    typedef std::vector<Name> NameList;
+    typedef std::map<Utf8::CodePoint, NameList>::iterator ShardIterator;
+
+    struct Subtree {
+        const StringTrie<Pointer> *trie;
+        size_t prefix_length;
+        std::string name;
+        // of its prefix filter in the root document
+        size_t filter_bytes;
+    };
+
+    // the filters cover the prefixes up to this many code points at most
+    static const size_t MAX_FILTER_PREFIX_LENGTH = 32;
+
+    struct Completion {
+        // the full name, in completion_names
+        const std::string *name;
+        Pointer value;
+    };
+    typedef std::vector<Completion> Completions;
+
+    struct NodeCompletions {
+        size_t n_names;
+        Completions best;
+    };
+
+    // names in traversal order, grouped by their first character
+    std::map<Utf8::CodePoint, NameList> shards;
+    StringTrie<Pointer> compressed_trie;
+
+    OutputSink &out;
+    std::ostream &log;
+    std::string json_prefix;
+    int n_threads;
+    size_t top_k;
+    SubtreeParams subtree_params;
+
+    // of the trie nodes with children
+    std::unordered_map<const StringTrie<Pointer>*, NodeCompletions> completions;
+    std::deque<std::string> completion_names;
+
+    // indexed by node id
+    std::vector<bool> visited;
+    int n_traversals;
+    size_t n_redundant_visits;
+
+    /** Returns false if the node was already visited */
+    bool mark_visited(int id) {
+        if (id >= int(visited.size())) visited.resize(id*2 + 1, false);
+        if (visited[id]) return false;
+        visited[id] = true;
+        return true;
+    }
+
+    void add_names(const TreeOfLife &tree, int subtree_id) {
+        if (mark_visited(tree.id)) visit(tree, subtree_id);
+        else n_redundant_visits++;
+        for (TreeOfLife::const_iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+            add_names(*c, subtree_id);
+    }
+
+    void visit(const TreeOfLife &tree, int subtree_id) {
+        if (tree.name.size() > 0)
+            visit(tree.name, tree.ext_id, tree.id, tree.total_leaves, subtree_id);
+    }
+
+    void visit(std::string name, std::string ext_id, int id, int total_leaves, int subtree_id) {
+        Name n = {
+            std::move(name), std::move(ext_id), { id, subtree_id, total_leaves }, n_traversals
+        };
+        normalize_case(n.name);
+        NameList &shard = shards[Utf8::first(n.name)];
+        shard.push_back(std::move(n));
+    }
+
+    static void insert(UnicodeTrie<Pointer> &char_trie, const Name &n) {
+        const Pointer* existing = char_trie.lookup(n.name);
+
+        if (existing) {
+            if (existing->id == n.value.id) return;
+            const std::string name = n.name + " (" + n.ext_id + ")";
+            existing = char_trie.lookup(name);
+            if (existing && existing->id == n.value.id) return;
+            char_trie.insert(name, n.value);
+        }
+        else char_trie.insert(n.name, n.value);
+    }
+
+    static bool serial_order(const Name &a, const Name &b) {
+        if (a.traversal != b.traversal) return a.traversal < b.traversal;
+        return a.value.id < b.value.id;
+    }
+
+    static bool larger_shard(ShardIterator a, ShardIterator b) {
+        return a->second.size() > b->second.size();
+    }
+
+    static bool better_completion(const Completion &a, const Completion &b) {
+        if (a.value.weight != b.value.weight) return a.value.weight > b.value.weight;
+        return *a.name < *b.name;
+    }
+
+    /**
+     * Stores the top_k completions of the nodes below trie, returns those of
+     * trie and adds the number of names below it to n_names
+     */
+    Completions compute_completions(const StringTrie<Pointer> &trie, std::string &prefix,
+                                    size_t &n_names) {
+        Completions candidates;
+        size_t n_below = 0;
+        if (trie.has_value) {
+            n_below++;
+            completion_names.push_back(prefix);
+            Completion c = { &completion_names.back(), trie.value };
+            candidates.push_back(c);
+        }
+
+        for (StringTrie<Pointer>::const_iterator c = trie.children.begin();
+            c != trie.children.end(); ++c) {
+            prefix += c->first;
+            Completions below = compute_completions(c->second, prefix, n_below);
+            candidates.insert(candidates.end(), below.begin(), below.end());
+            prefix.resize(prefix.size() - c->first.size());
+        }
+
+        const size_t n = std::min(top_k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+            better_completion);
+        candidates.resize(n);
+
+        if (trie.children.size() > 0) {
+            NodeCompletions &node = completions[&trie];
+            node.n_names = n_below;
+            node.best = candidates;
+        }
+        n_names += n_below;
+        return candidates;
+    }
+
+    /** With always = false, only if there are more than top_k names below */
+    template <class Writer>
+    void write_completions_json(const StringTrie<Pointer> &trie, size_t prefix_length,
+                                bool always, Writer &json) const {
+        std::unordered_map<const StringTrie<Pointer>*, NodeCompletions>::const_iterator
+            itr = completions.find(&trie);
+        if (itr == completions.end()) return;
+        if (!always && itr->second.n_names <= top_k) return;
+
+        const Completions &best = itr->second.best;
+        json.key("t").begin('[');
+        for (size_t i = 0; i < best.size(); ++i) {
+            const Completion &c = best[i];
+            json.begin('[')
+                .value(c.name->substr(prefix_length))
+                .value(c.value.id)
+                .value(c.value.subtree)
+            .end(']');
+        }
+        json.end(']');
+    }
+
+    /** StringTrie::write_json with the completions */
+    template <class Writer>
+    void write_trie_json(const StringTrie<Pointer> &trie, size_t prefix_length,
+                         Writer &json) const {
+        json.begin('{');
+
+        if (trie.children.size() > 0) {
+            json.key("c");
+            json.begin('{');
+
+            for(StringTrie<Pointer>::const_iterator c = trie.children.begin();
+                c != trie.children.end();
+                ++c)
+            {
+                json.key(c->first);
+                write_trie_json(c->second, prefix_length + c->first.size(), json);
+            }
+            json.end('}');
+        }
+
+        write_completions_json(trie, prefix_length, false, json);
+        write_value_json(trie, json);
+        json.end('}');
+    }
+
+    template <class Writer>
+    void write_value_json(const StringTrie<Pointer> &trie, Writer &json) const {
+        if (!trie.has_value) return;
+        if (top_k > 0 && trie.value.weight > 1) {
+            json.key("v").begin('[')
+                .value(trie.value.id)
+                .value(trie.value.subtree)
+                .value(trie.value.weight)
+            .end(']');
+        }
+        else json.key("v").value(trie.value);
+    }
+
+    void decomposed_write_json(
+            const StringTrie<Pointer> &tree,
+            size_t prefix_length,
+            JsonWriter &root_json,
+            std::vector<Subtree> &subtrees) const {
+
+        root_json.begin('{');
+
+        if (tree.total_nodes <= subtree_params.max_subtree_size &&
+            tree.total_nodes >= subtree_params.min_subtree_size) {
+            int idx = subtrees.size() + 1;
+            root_json.key("subtree_index").value(idx);
+            const size_t filter_bytes = write_prefix_filter_json(tree, root_json);
+            write_completions_json(tree, prefix_length, true, root_json);
+            Subtree subtree = { &tree, prefix_length, json_prefix + to_string(idx), filter_bytes };
+            subtrees.push_back(subtree);
+        }
+        else {
+
+            if (tree.children.size() > 0) {
+                root_json.key("c");
+                root_json.begin('{');
+
+                for(StringTrie<Pointer>::const_iterator c = tree.children.begin();
+                    c != tree.children.end();
+                    ++c)
+                {
+                    root_json.key(c->first);
+                    decomposed_write_json(c->second, prefix_length + c->first.size(),
+                        root_json, subtrees);
+                }
+                root_json.end('}');
+            }
+
+            write_completions_json(tree, prefix_length, true, root_json);
+            write_value_json(tree, root_json);
+        }
+
+        root_json.end('}');
+    }
+
+    /**
+     * Writes a Bloom filter of the prefixes of the names below trie,
+     * relative to it, so that search.js can tell most misses without
+     * fetching the subtree:
+     *
+     *   "b": {"l": length, "m": bits, "k": hashes, "f": base64 bits}
+     *
+     * Only the prefixes of at most length code points are included, the
+     * longest that fit filter_bytes. Returns the bytes of the filter.
+     */
+    template <class Writer>
+    size_t write_prefix_filter_json(const StringTrie<Pointer> &trie, Writer &json) const {
+        if (subtree_params.filter_bytes <= 0) return 0;
+        const double bits_per_prefix = subtree_params.filter_bits_per_prefix;
+
+        std::vector<size_t> counts;
+        count_prefixes(trie, 0, counts);
+
+        size_t length = 0, n_prefixes = 0;
+        while (length < counts.size() &&
+            (n_prefixes + counts[length]) * bits_per_prefix <= subtree_params.filter_bytes * 8.0) {
+            n_prefixes += counts[length];
+            length++;
+        }
+        if (length == 0) return 0;
+
+        BloomFilter filter(n_prefixes, bits_per_prefix);
+        add_prefixes(trie, BloomFilter::Hash(), 0, length, filter);
+
+        json.key("b").begin('{')
+            .key("l").value(int(length))
+            .key("m").value(int(filter.size_bits()))
+            .key("k").value(filter.hashes())
+            .key("f").value(filter.to_base64())
+        .end('}');
+        return filter.size_bits() / 8;
+    }
+
+    /** Adds the number of prefixes of each length below trie to counts */
+    static void count_prefixes(const StringTrie<Pointer> &trie, size_t depth,
+                               std::vector<size_t> &counts) {
+        for (StringTrie<Pointer>::const_iterator c = trie.children.begin();
+            c != trie.children.end(); ++c) {
+            const std::string &edge = c->first;
+            size_t d = depth;
+            for (size_t i = 0; i < edge.size() && d < MAX_FILTER_PREFIX_LENGTH; ++i) {
+                if (!ends_code_point(edge, i)) continue;
+                if (counts.size() <= d) counts.resize(d + 1, 0);
+                counts[d++]++;
+            }
+            if (d < MAX_FILTER_PREFIX_LENGTH) count_prefixes(c->second, d, counts);
+        }
+    }
+
+    /** Adds the prefixes of at most max_length code points below trie */
+    static void add_prefixes(const StringTrie<Pointer> &trie, const BloomFilter::Hash &hash,
+                             size_t depth, size_t max_length, BloomFilter &filter) {
+        for (StringTrie<Pointer>::const_iterator c = trie.children.begin();
+            c != trie.children.end(); ++c) {
+            const std::string &edge = c->first;
+            BloomFilter::Hash prefix = hash;
+            size_t d = depth;
+            for (size_t i = 0; i < edge.size() && d < max_length; ++i) {
+                prefix.update(&edge[i], 1);
+                if (!ends_code_point(edge, i)) continue;
+                filter.add(prefix);
+                d++;
+            }
+            if (d < max_length) add_prefixes(c->second, prefix, d, max_length, filter);
+        }
+    }
+
+    static bool ends_code_point(const std::string &str, size_t i) {
+        return i + 1 == str.size() || (str[i+1] & 0xc0) != 0x80;
+    }
+
+    /** Capitalizes the first letter of the string (if an ASCII char) */
+    void normalize_case(std::string &str) {
+        assert(str.size() > 0);
+        if (str[0] >= 'a' && str[0] <= 'z') str[0] = str[0] + ('A'-'a');
+    }
+};
+
+#endif
@@ -0,0 +1,560 @@
+#ifndef __SNAPSHOT_HPP
+#define __SNAPSHOT_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <json.hpp>
+#include <tree.hpp>
+
+/**
+ * A compact binary image of a parsed TreeOfLife that can be memory-mapped
+ * and used as is. The file consists of a header, a flat array of nodes in
+ * preorder and a string table. The children of the node at index i are
+ * found at i+1, i+1+size(i+1), ... so no child pointers are stored, in
+ * the display order of TreeOfLife.
+ */
+class TreeSnapshot {
+public:
+    typedef std::runtime_error error;
+
+    static const uint32_t VERSION = 2;
+
+    struct Node {
+        int32_t id;
+        int32_t total_leaves;
+        int32_t total_nodes;
+        // offsets of NUL-terminated strings in the string table
+        uint32_t name;
+        uint32_t ext_id;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t node_count;
+        uint64_t strings_size;
+        uint64_t checksum;
+    };
+
+    static void write(const TreeOfLife &tree, std::string filename) {
+        std::string image = serialize(tree);
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write(image.data(), image.size());
+        if (!out) throw error("could not write snapshot "+filename);
+    }
+
+    /** Maps a snapshot file */
+    TreeSnapshot(std::string filename, bool verify_checksum = true) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw error("could not open snapshot "+filename);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw error("could not stat snapshot "+filename);
+        }
+        mapped_size = st.st_size;
+
+        if (mapped_size < sizeof(Header)) {
+            close(fd);
+            throw error("truncated snapshot "+filename);
+        }
+
+        mapped = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) throw error("could not map snapshot "+filename);
+
+        try { validate(verify_checksum); }
+        catch (...) {
+            munmap(mapped, mapped_size);
+            throw;
+        }
+    }
+
+    /** An in-memory snapshot of the given tree */
+    explicit TreeSnapshot(const TreeOfLife &tree) :
+        image(serialize(tree)),
+        mapped((void*)image.data()),
+        mapped_size(image.size())
+    {}
+
+    ~TreeSnapshot() { if (image.empty()) munmap(mapped, mapped_size); }
+
+    size_t size() const { return header().node_count; }
+
+    const Node &node(size_t i) const { return nodes()[i]; }
+    const char *name(size_t i) const { return strings() + node(i).name; }
+    const char *ext_id(size_t i) const { return strings() + node(i).ext_id; }
+
+    // preorder navigation, returns size() if there is no such node
+    size_t first_child(size_t i) const {
+        return node(i).total_nodes > 1 ? i + 1 : size();
+    }
+    size_t next_sibling(size_t parent, size_t child) const {
+        size_t next = child + node(child).total_nodes;
+        return next < parent + node(parent).total_nodes ? next : size();
+    }
+
+    /**
+     * Rebuilds the pointer-based tree rooted at the given node, with one
+     * allocation per node, for the operations that change the tree such as
+     * TreeOfLife::collapse_unary. The decomposition, its subtree documents
+     * and the search traversal work on the mapped nodes directly, see
+     * iterative_decomposition.
+     */
+    TreeOfLife to_tree(size_t root = 0) const {
+        int unused_id = 0;
+        TreeOfLife tree(unused_id);
+        copy_to(root, tree);
+        return tree;
+    }
+
+    /**
+     * Writes the subtree of the given node in the format of the "data"
+     * member of the subtree files, down to max_depth levels and with at most
+     * max_nodes nodes, filled breadth-first. Nodes whose children were cut
+     * off are marked with "more":true.
+     */
+    template <class Writer>
+    void write_json(Writer &json, size_t root, int max_depth, int max_nodes) const {
+        std::vector<size_t> expanded, frontier(1, root), next;
+        int budget = max_nodes - 1;
+
+        for (int depth = 0; depth < max_depth && budget > 0; ++depth) {
+            next.clear();
+            for (size_t i = 0; i < frontier.size(); ++i) {
+                const size_t parent = frontier[i];
+                size_t n_children = 0;
+                for (size_t c = first_child(parent); c < size(); c = next_sibling(parent, c))
+                    n_children++;
+
+                if (n_children == 0) continue;
+                if (int(n_children) > budget) {
+                    budget = 0;
+                    break;
+                }
+                budget -= n_children;
+                expanded.push_back(parent);
+                for (size_t c = first_child(parent); c < size(); c = next_sibling(parent, c))
+                    next.push_back(c);
+            }
+            frontier.swap(next);
+        }
+
+        std::sort(expanded.begin(), expanded.end());
+        write_node_json(json, root, expanded);
+    }
+
+    /**
+     * A subtree of iterative_decomposition on the mapped nodes: the clade
+     * of root, of which only max_overlap_depth levels (at least one) of the
+     * child subtrees split off from it are included, their roots marked
+     * with their subtree ids. Its documents are the same, byte for byte, as
+     * those of the TreeOfLife copy.
+     */
+    class Subtree {
+    public:
+        Subtree(const TreeSnapshot &owner_, size_t root_, int max_overlap_depth) :
+            owner(&owner_), root(root_), overlap_depth(std::max(1, max_overlap_depth))
+        {}
+
+        const TreeSnapshot &snapshot() const { return *owner; }
+        size_t root_index() const { return root; }
+
+        /** TreeOfLife::write_json */
+        template <class Writer> void write_json(Writer &json, int schema = 1) const {
+            std::map<int, int> parent_map;
+            json.begin('{');
+            if (schema >= 2) json.key("v").value(schema);
+
+            json.key("data");
+            write_content_json(json, root, 0, -1, parent_map);
+
+            if (schema < 2) TreeOfLife::write_parents_json(json, parent_map);
+            json.end('}');
+        }
+
+        /** TreeOfLife::write_lod_json */
+        template <class Writer>
+        void write_lod_json(Writer &json, const TreeOfLife::LodParams &params, int subtree_id,
+                            int schema = 1) const {
+            const int min_leaves = int(params.min_weight * owner->node(root).total_leaves);
+            std::map<int, int> parent_map;
+            json.begin('{');
+            if (schema >= 2) json.key("v").value(schema);
+
+            json.key("data");
+            write_lod_content_json(json, root, 0, -1, params.max_depth, min_leaves, subtree_id,
+                parent_map);
+
+            if (schema < 2) TreeOfLife::write_parents_json(json, parent_map);
+            json.end('}');
+        }
+
+        /** Calls visit(i) for the index i of each included node, in preorder */
+        template <class Visitor> void visit_nodes(Visitor &visit) const {
+            visit_nodes(visit, root, -1);
+        }
+
+    private:
+        friend class TreeSnapshot;
+
+        const TreeSnapshot *owner;
+        size_t root;
+        int overlap_depth;
+        // the roots of the child subtrees in preorder, with their ids
+        std::vector< std::pair<size_t, int> > splits;
+
+        /** The id of the child subtree rooted at node i, or 0 */
+        int split_id(size_t i) const {
+            std::vector< std::pair<size_t, int> >::const_iterator itr =
+                std::lower_bound(splits.begin(), splits.end(), std::make_pair(i, 0));
+            return itr != splits.end() && itr->first == i ? itr->second : 0;
+        }
+
+        /**
+         * Writes the fields of TreeOfLife::write_node_fields_json. overlap
+         * is the depth below the root of a child subtree, -1 outside of
+         * them, and becomes 0 at such a root. Returns whether the children
+         * of node i are included.
+         */
+        template <class Writer>
+        bool write_node_fields_json(Writer &json, size_t i, int leaf_offset, int &overlap) const {
+            const Node &n = owner->node(i);
+            json.key("i").value(n.id);
+            if (*owner->name(i) != '\0') json.key("n").value(owner->name(i));
+
+            json.key("s").value(n.total_leaves);
+            if (leaf_offset > 0 && i != root) json.key("o").value(leaf_offset);
+
+            const int subtree_index = split_id(i);
+            if (subtree_index > 0) {
+                json.key("subtree_index").value(subtree_index);
+                overlap = 0;
+            }
+            return n.total_nodes > 1 && overlap < overlap_depth;
+        }
+
+        template <class Writer>
+        void write_content_json(Writer &json, size_t i, int leaf_offset, int overlap,
+                                std::map<int, int> &parent_map) const {
+            json.begin('{');
+            if (write_node_fields_json(json, i, leaf_offset, overlap)) {
+                json.key("c");
+                json.begin('[');
+                int offset = 0;
+                for (size_t c = owner->first_child(i); c < owner->size(); c = owner->next_sibling(i, c)) {
+                    parent_map[owner->node(c).id] = owner->node(i).id;
+                    write_content_json(json, c, offset, overlap < 0 ? -1 : overlap + 1, parent_map);
+                    offset += owner->node(c).total_leaves;
+                }
+                json.end(']');
+            }
+            json.end('}');
+        }
+
+        template <class Writer>
+        void write_lod_content_json(Writer &json, size_t i, int leaf_offset, int overlap,
+                int depth_left, int min_leaves, int subtree_id,
+                std::map<int, int> &parent_map) const {
+            json.begin('{');
+            if (write_node_fields_json(json, i, leaf_offset, overlap)) {
+                int n_small = 0, small_leaves = 0, small_nodes = 0, large_leaves = 0;
+                for (size_t c = owner->first_child(i); c < owner->size(); c = owner->next_sibling(i, c)) {
+                    const Node &child = owner->node(c);
+                    if (depth_left <= 0 || child.total_leaves < min_leaves) {
+                        n_small++;
+                        small_leaves += child.total_leaves;
+                        small_nodes += child.total_nodes;
+                    }
+                    else large_leaves += child.total_leaves;
+                }
+                const bool collapse = small_nodes > 1;
+
+                json.key("c");
+                json.begin('[');
+                int offset = 0;
+                for (size_t c = owner->first_child(i); c < owner->size(); c = owner->next_sibling(i, c)) {
+                    const Node &child = owner->node(c);
+                    const int child_offset = offset;
+                    offset += child.total_leaves;
+                    if (collapse && (depth_left <= 0 || child.total_leaves < min_leaves)) continue;
+                    parent_map[child.id] = owner->node(i).id;
+                    write_lod_content_json(json, c, child_offset, overlap < 0 ? -1 : overlap + 1,
+                        depth_left - 1, min_leaves, subtree_id, parent_map);
+                }
+                if (collapse) {
+                    json.begin('{');
+                    json.key("s").value(small_leaves);
+                    if (large_leaves > 0) json.key("o").value(large_leaves);
+                    json.key("g").begin('{')
+                        .key("k").value(n_small)
+                        .key("t").value(small_nodes)
+                        .key("f").value(subtree_id)
+                    .end('}');
+                    json.end('}');
+                }
+                json.end(']');
+            }
+            json.end('}');
+        }
+
+        template <class Visitor> void visit_nodes(Visitor &visit, size_t i, int overlap) const {
+            visit(i);
+            if (split_id(i) > 0) overlap = 0;
+            if (owner->node(i).total_nodes == 1 || overlap >= overlap_depth) return;
+            for (size_t c = owner->first_child(i); c < owner->size(); c = owner->next_sibling(i, c))
+                visit_nodes(visit, c, overlap < 0 ? -1 : overlap + 1);
+        }
+    };
+
+    /**
+     * TreeOfLife::iterative_decomposition on the mapped nodes: the same
+     * subtrees, parents map and prefetch hints, where out[i] is subtree i.
+     * Since the splits only depend on the clade sizes and no node is
+     * copied or trimmed, this is a serial scan of the large clades.
+     */
+    std::map<int,int> iterative_decomposition(std::vector<Subtree> &out,
+            const TreeOfLife::DecompositionParams &params = TreeOfLife::DecompositionParams(),
+            TreeOfLife::PrefetchHints *hints = NULL) const {
+
+        std::map<int,int> parent_map;
+        out.clear();
+        out.push_back(Subtree(*this, 0, params.max_overlap_depth));
+        std::vector<int> roots(1, 0);
+
+        for (size_t itr = 0; itr < params.max_subtree_sizes.size(); ++itr) {
+            const int max_subtree_size = params.max_subtree_sizes[itr];
+            std::vector<int> new_roots;
+
+            std::cerr << "decomposition iteration "  << itr+1 << ", "
+                      << roots.size() << " root(s)" << std::endl;
+
+            for (size_t r = 0; r < roots.size(); ++r) {
+                const int root_id = roots[r];
+                const size_t root = out[root_id].root;
+                if (node(root).total_nodes <= max_subtree_size) continue;
+
+                std::vector< std::pair<size_t, int> > found;
+                find_splits(root, max_subtree_size, params, 0, found);
+
+                const int first_id = out.size();
+                std::vector<TreeOfLife::PrefetchHint> split_hints;
+                for (size_t j = 0; j < found.size(); ++j) {
+                    const int subtree_id = out.size();
+                    out.push_back(Subtree(*this, found[j].first, params.max_overlap_depth));
+                    out[root_id].splits.push_back(std::make_pair(found[j].first, subtree_id));
+                    parent_map[subtree_id] = root_id;
+
+                    TreeOfLife::PrefetchHint hint = {
+                        subtree_id, node(found[j].first).total_leaves, found[j].second
+                    };
+                    split_hints.push_back(hint);
+                }
+                if (hints != NULL && !split_hints.empty())
+                    TreeOfLife::add_prefetch_hints(split_hints, params, (*hints)[root_id]);
+
+                for (int id = int(out.size()) - 1; id >= first_id; --id) new_roots.push_back(id);
+            }
+            roots = new_roots;
+        }
+        return parent_map;
+    }
+
+private:
+    static const char *magic() { return "TOLSNAP"; }
+
+    // owned data of in-memory snapshots, empty if mapped from a file
+    const std::string image;
+    void *mapped;
+    size_t mapped_size;
+
+    // non-copyable
+    TreeSnapshot(const TreeSnapshot&);
+    TreeSnapshot& operator=(const TreeSnapshot&);
+
+    const Header &header() const { return *(const Header*)mapped; }
+    const Node *nodes() const {
+        return (const Node*)((const char*)mapped + sizeof(Header));
+    }
+    const char *strings() const {
+        return (const char*)(nodes() + size());
+    }
+
+    void validate(bool verify_checksum) const {
+        const Header &h = header();
+        if (memcmp(h.magic, magic(), sizeof(h.magic)) != 0)
+            throw error("not a tree snapshot");
+        if (h.version != VERSION)
+            throw error("unsupported snapshot version "+to_string(h.version));
+
+        const uint64_t nodes_size = uint64_t(h.node_count)*sizeof(Node);
+        if (sizeof(Header) + nodes_size + h.strings_size != mapped_size)
+            throw error("snapshot size mismatch");
+
+        if (verify_checksum &&
+            checksum(nodes(), nodes_size, checksum(strings(), h.strings_size)) != h.checksum)
+            throw error("snapshot checksum mismatch");
+
+        validate_nodes();
+    }
+
+    /**
+     * Checks that the strings are in the string table and that the nodes
+     * nest as in a preorder, i.e., every node lies within its parent and
+     * the root spans all of them, so that navigation stays in bounds.
+     */
+    void validate_nodes() const {
+        const uint64_t strings_size = header().strings_size;
+        if (strings_size == 0 || strings()[strings_size-1] != '\0')
+            throw error("snapshot string table not terminated");
+        if (size() == 0 || node(0).total_nodes != int64_t(size()))
+            throw error("snapshot root does not span the nodes");
+
+        // the ends of the open ancestors of node i
+        std::vector<size_t> ends;
+        for (size_t i = 0; i < size(); ++i) {
+            const Node &n = node(i);
+            if (n.name >= strings_size || n.ext_id >= strings_size)
+                throw error("snapshot string offset out of range at node "+to_string(i));
+            if (n.total_nodes < 1 || n.total_leaves < 1)
+                throw error("snapshot node "+to_string(i)+" is empty");
+
+            while (!ends.empty() && ends.back() <= i) ends.pop_back();
+            const size_t end = i + n.total_nodes;
+            if (!ends.empty() && end > ends.back())
+                throw error("snapshot node "+to_string(i)+" overlaps its parent");
+            ends.push_back(end);
+        }
+    }
+
+    template <class Writer>
+    void write_node_json(Writer &json, size_t i, const std::vector<size_t> &expanded,
+                         int leaf_offset = 0) const {
+        json.begin('{');
+
+        json.key("i").value(node(i).id);
+        if (*name(i) != '\0') json.key("n").value(name(i));
+        json.key("s").value(node(i).total_leaves);
+        if (leaf_offset > 0) json.key("o").value(leaf_offset);
+
+        if (node(i).total_nodes > 1) {
+            if (std::binary_search(expanded.begin(), expanded.end(), i)) {
+                json.key("c");
+                json.begin('[');
+                int offset = 0;
+                for (size_t c = first_child(i); c < size(); c = next_sibling(i, c)) {
+                    write_node_json(json, c, expanded, offset);
+                    offset += node(c).total_leaves;
+                }
+                json.end(']');
+            }
+            else json.key("more").value(true);
+        }
+        json.end('}');
+    }
+
+    static std::string serialize(const TreeOfLife &tree) {
+        std::vector<Node> nodes;
+        std::string strings(1, '\0'); // offset 0 is the empty string
+
+        nodes.reserve(tree.total_nodes);
+        flatten(tree, nodes, strings);
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.version = VERSION;
+        header.node_count = nodes.size();
+        header.strings_size = strings.size();
+        header.checksum = checksum(nodes.data(), nodes.size()*sizeof(Node),
+            checksum(strings.data(), strings.size()));
+
+        std::string image;
+        image.reserve(sizeof(header) + nodes.size()*sizeof(Node) + strings.size());
+        image.append((const char*)&header, sizeof(header));
+        image.append((const char*)nodes.data(), nodes.size()*sizeof(Node));
+        image.append(strings);
+        return image;
+    }
+
+    static void flatten(const TreeOfLife &tree, std::vector<Node> &nodes, std::string &strings) {
+        Node n;
+        n.id = tree.id;
+        n.total_leaves = tree.total_leaves;
+        n.total_nodes = tree.total_nodes;
+        n.name = add_string(tree.name, strings);
+        n.ext_id = add_string(tree.ext_id, strings);
+        nodes.push_back(n);
+
+        for (TreeOfLife::const_iterator itr = tree.children.begin();
+            itr != tree.children.end(); ++itr)
+            flatten(*itr, nodes, strings);
+    }
+
+    static uint32_t add_string(const std::string &str, std::string &strings) {
+        if (str.empty()) return 0;
+        uint32_t offset = strings.size();
+        strings.append(str.c_str(), str.size()+1);
+        return offset;
+    }
+
+    /** TreeOfLife::find_splits: the clades to split off below node i in preorder, with their depths */
+    void find_splits(size_t i, int max_subtree_size, const TreeOfLife::DecompositionParams &params,
+                     int depth, std::vector< std::pair<size_t, int> > &found) const {
+        const int total_nodes = node(i).total_nodes;
+        if (total_nodes <= max_subtree_size && total_nodes >= params.min_subtree_size) {
+            found.push_back(std::make_pair(i, depth));
+            return;
+        }
+        for (size_t c = first_child(i); c < size(); c = next_sibling(i, c))
+            find_splits(c, max_subtree_size, params, depth + 1, found);
+    }
+
+    void copy_to(size_t i, TreeOfLife &tree) const {
+        int unused_id = 0;
+        tree.id = node(i).id;
+        tree.total_leaves = node(i).total_leaves;
+        tree.total_nodes = node(i).total_nodes;
+        tree.name = name(i);
+        tree.ext_id = ext_id(i);
+
+        int offset = 0;
+        for (size_t c = first_child(i); c < size(); c = next_sibling(i, c)) {
+            TreeOfLife &child = tree.children.emplace_back(unused_id);
+            copy_to(c, child);
+            child.leaf_offset = offset;
+            offset += node(c).total_leaves;
+        }
+    }
+
+    /** 64-bit FNV-1a variant that consumes 8 bytes per round */
+    static uint64_t checksum(const void *data, size_t size,
+                             uint64_t hash = 14695981039346656037ULL) {
+        const uint64_t PRIME = 1099511628211ULL;
+        const char *bytes = (const char*)data;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, bytes + i, 8);
+            hash = (hash ^ word) * PRIME;
+        }
+        for (; i < size; ++i) hash = (hash ^ (unsigned char)bytes[i]) * PRIME;
+        return hash;
+    }
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __SYNTHETIC_HPP
+#define __SYNTHETIC_HPP
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+
+/**
+ * A random Newick tree with n_nodes nodes named "node<k>_ott<k>", for tests
+ * and benchmarks. Node k is attached to a random earlier node.
+ */
+inline std::string random_newick(int n_nodes, unsigned seed) {
+    std::vector< std::vector<int> > children(n_nodes);
+    srand(seed);
+    for (int k = 1; k < n_nodes; ++k) children[rand() % k].push_back(k);
+    
+    std::vector<std::string> newick(n_nodes);
+    for (int k = n_nodes-1; k >= 0; --k) {
+        std::string &s = newick[k];
+        if (children[k].size() > 0) {
+            s = "(";
+            for (size_t c = 0; c < children[k].size(); ++c)
+                s += (c > 0 ? "," : "") + newick[children[k][c]];
+            s += ")";
+        }
+        s += "node" + to_string(k) + "_ott" + to_string(k);
+    }
+    return newick[0] + ";";
+}
+
+#endif
@@ -1,17 +1,22 @@
 #ifndef __TREE_HPP
 #define __TREE_HPP
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <stdexcept>
 #include <list>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 #include <assert.h>
 
 #include <json.hpp>
+#include <newick.hpp>
+#include <parallel.hpp>
 
 class TreeOfLife {
 public:
@@ -24,66 +29,166 @@ public:
     typedef std::list<TreeOfLife>::const_iterator const_iterator;
     
     TreeOfLife(std::istream &newick_input) {
-        int global_id = 1;
-        init(global_id);
-        read_newick(newick_input, 0, global_id);
+        const std::string newick = NewickReader::read_stream(newick_input);
+        parse_newick(newick.data(), newick.size(), 1);
     }
 
-    void write_json(JsonWriter &json) const {
-        std::map<int, int> parent_map;
-        generate_parent_map(parent_map);
+    /** Parses a buffer, numbering the nodes in preorder from first_id */
+    TreeOfLife(const char *newick, size_t size, int first_id = 1) {
+        parse_newick(newick, size, first_id);
+    }
+
+    /** An empty node that takes the next id of the counter */
+    explicit TreeOfLife(int &global_id) { init(global_id); }
+
+    /**
+     * The subtree document {"data": nodes, "parents": {"id": parent id, ...}}
+     * or, in schema 2, {"v": 2, "data": nodes}, whose parents are implied
+     * by the nesting
+     */
+    template <class Writer> void write_json(Writer &json, int schema = 1) const {
         json.begin('{');
+        if (schema >= 2) json.key("v").value(schema);
         
         json.key("data");
         write_content_json(json);
         
-        json.key("parents");
-        json.begin('{');
-        for(std::map<int, int>::const_iterator itr = parent_map.begin();
-            itr != parent_map.end(); ++itr)
-            json.key(to_string(itr->first)).value(itr->second);
+        if (schema < 2) {
+            std::map<int, int> parent_map;
+            generate_parent_map(parent_map);
+            write_parents_json(json, parent_map);
+        }
         json.end('}');
+    }
+    
+    /** Parameters of the level-of-detail subtree documents */
+    struct LodParams {
+        // children of nodes this deep below the root are always collapsed
+        int max_depth;
+        // children with fewer leaves than this fraction of the root are collapsed
+        double min_weight;
+        
+        LodParams() : max_depth(6), min_weight(0.005) {}
+    };
+    
+    /**
+     * Like write_json, but the small children of each node are collapsed
+     * into a single aggregate node
+     *
+     *   {"s": leaves, "g": {"k": children, "t": nodes, "f": subtree_id}}
+     *
+     * whose full detail is in the subtree document subtree_id. The parents
+     * map only covers the nodes that are included.
+     */
+    template <class Writer>
+    void write_lod_json(Writer &json, const LodParams &params, int subtree_id,
+                        int schema = 1) const {
+        const int min_leaves = int(params.min_weight * total_leaves);
+        std::map<int, int> parent_map;
+        json.begin('{');
+        if (schema >= 2) json.key("v").value(schema);
         
+        json.key("data");
+        write_lod_content_json(json, params.max_depth, min_leaves, subtree_id, parent_map);
+        
+        if (schema < 2) write_parents_json(json, parent_map);
         json.end('}');
     }
     
+    /** Parameters of iterative_decomposition */
+    struct DecompositionParams {
+        // one iteration per size, each splits the subtrees larger than it
+        std::vector<int> max_subtree_sizes;
+        // smaller clades are not split off
+        int min_subtree_size;
+        // levels below a split-off clade that also stay in the parent subtree
+        int max_overlap_depth;
+        // the child subtrees listed as prefetch hints of each subtree
+        int max_prefetch_hints;
+        // the subtrees do not depend on this; serial by default, since the
+        // copies are mostly allocations and more threads were not faster
+        // in bin/bench decompose
+        int n_threads;
+        
+        DecompositionParams() :
+            min_subtree_size(10000), max_overlap_depth(1), max_prefetch_hints(8),
+            n_threads(1)
+        {
+            max_subtree_sizes.push_back(500000);
+            max_subtree_sizes.push_back(100000);
+            max_subtree_sizes.push_back(50000);
+        }
+    };
+    
+    /** A subtree split off from another one, depth levels below its root */
+    struct PrefetchHint {
+        int subtree_id, total_leaves, depth;
+        
+        /** The larger and the closer to the root, the likelier to be entered */
+        double weight() const { return total_leaves * std::pow(0.5, depth); }
+    };
+    
+    /** The hints of each subtree that has child subtrees, most likely first */
+    typedef std::map<int, std::vector<PrefetchHint> > PrefetchHints;
+    
     /**
      * An ad-hoc methods for splitting the tree of tree of life to overlapping
-     * subtrees
+     * subtrees. If hints is given, it gets the child subtrees of each
+     * subtree that are most likely to be entered next.
+     *
+     * The clades to split off are found and copied as tasks on
+     * params.n_threads threads and numbered in between in the preorder of
+     * a serial traversal, so the subtrees and their ids do not depend on
+     * the threads.
      */
-    std::map<int,int> iterative_decomposition(std::list<TreeOfLife> &out) {
-        
-        const int DECOMPOSITION_ITR = 3;
-        
-        const int MAX_SUBTREE_SIZES[] = {
-            500000,
-            100000,
-            50000
-        };
+    std::map<int,int> iterative_decomposition(std::list<TreeOfLife> &out,
+            const DecompositionParams &params = DecompositionParams(),
+            PrefetchHints *hints = NULL) {
         
         std::map<int,int> parent_map;
+        WorkStealingScheduler scheduler(params.n_threads);
         
         typedef std::pair<TreeOfLife*,int> TreeIdPair;
         std::vector<TreeIdPair> roots;
         roots.push_back(TreeIdPair(this,0));
         
-        for (int itr=0; itr < DECOMPOSITION_ITR; ++itr) {
-            const int max_subtree_size = MAX_SUBTREE_SIZES[itr];
+        for (size_t itr=0; itr < params.max_subtree_sizes.size(); ++itr) {
+            const int max_subtree_size = params.max_subtree_sizes[itr];
             
             std::vector<TreeIdPair> new_roots;
             
             std::cerr << "decomposition iteration "  << itr+1 << ", "
                       << roots.size() << " root(s)" << std::endl;
             
+            std::vector<SplitList> found(roots.size());
+            for (size_t i = 0; i < roots.size(); ++i) {
+                TreeOfLife *root = roots[i].first;
+                if (root->total_nodes <= max_subtree_size) continue;
+                SplitList *list = &found[i];
+                scheduler.spawn([root, list, max_subtree_size, &params, &scheduler](int worker) {
+                    root->find_splits(max_subtree_size, params, scheduler, worker, 0, *list);
+                });
+            }
+            scheduler.run();
+            
+            std::vector<Split> splits;
+            std::vector<PrefetchHint> split_hints;
             for (size_t i = 0; i < roots.size(); ++i) {
                 const size_t old_n_out = out.size();
-                
-                TreeOfLife &cur_root = *roots[i].first;
                 const int root_id = roots[i].second;
                 
-                if (cur_root.total_nodes > max_subtree_size)
-                    cur_root.decompose(out, max_subtree_size);
-                    
+                const size_t first_split = splits.size();
+                found[i].flatten(splits);
+                split_hints.clear();
+                for (size_t j = first_split; j < splits.size(); ++j) {
+                    int unused_id = 0;
+                    splits[j].copy = &out.emplace_back(unused_id);
+                    splits[j].subtree_id = out.size();
+                    PrefetchHint hint = { splits[j].subtree_id, splits[j].node->total_leaves, splits[j].depth };
+                    split_hints.push_back(hint);
+                }
+                if (hints != NULL && !split_hints.empty()) add_prefetch_hints(split_hints, params, (*hints)[root_id]);
+                
                 // avoid the temptation of changing out to a vector -> nasal demons
                 std::list<TreeOfLife>::reverse_iterator root_itr = out.rbegin();
                 for (size_t tree_id = out.size(); tree_id > old_n_out; --tree_id) {
@@ -93,128 +198,232 @@ public:
                 }
             }
             
+            for (size_t j = 0; j < splits.size(); ++j) {
+                const Split split = splits[j];
+                scheduler.spawn([split, &params](int) {
+                    *split.copy = *split.node; // deep copy
+                    split.node->subtree_index = split.subtree_id;
+                    split.node->trim_overlap(1, params.max_overlap_depth);
+                }, j % scheduler.threads());
+            }
+            scheduler.run();
+            
             roots = new_roots;
         }
         out.push_front(*this);
         return parent_map;
     }
     
+    /**
+     * Replaces the unnamed nodes with a single child, except the root, by
+     * that child, and recomputes total_nodes and the display order.
+     * collapsed maps the ids of the removed nodes to the ids of the nodes
+     * that took their place. Returns the number of removed nodes.
+     */
+    int collapse_unary(std::map<int, int> &collapsed) {
+        int n_removed = 0;
+        total_nodes = 1;
+        std::vector<int> removed_ids;
+        for (std::list<TreeOfLife>::iterator c = children.begin(); c != children.end(); ++c) {
+            removed_ids.clear();
+            while (c->name.empty() && c->children.size() == 1) {
+                removed_ids.push_back(c->id);
+                // move the grandchild into the place of the child
+                std::list<TreeOfLife>::iterator grandchild = c->children.begin();
+                children.splice(c, c->children);
+                children.erase(c);
+                c = grandchild;
+            }
+            for (size_t i = 0; i < removed_ids.size(); ++i) collapsed[removed_ids[i]] = c->id;
+            n_removed += removed_ids.size() + c->collapse_unary(collapsed);
+            total_nodes += c->total_nodes;
+        }
+        // the names that replaced unnamed nodes can change the order
+        sort_children();
+        return n_removed;
+    }
+    
+    /**
+     * The "data" member of write_json, the nodes without the parents map.
+     * The children are in display order and "o" is the sum of the leaves
+     * "s" of the siblings before a node, omitted if 0 and at the root.
+     */
+    template <class Writer> void write_content_json(Writer &json, bool root = true) const {
+        json.begin('{');
+        write_node_fields_json(json, root);
+        
+        if (children.size() > 0) {
+            
+            json.key("c");
+            json.begin('[');
+            for (const_iterator itr = children.begin();
+                itr != children.end();
+                ++itr)
+                itr->write_content_json(json, false);
+                    
+            json.end(']');
+        }
+        json.end('}');
+    }
+    
     typedef std::runtime_error error;
     
 private:
+    friend class TreeSnapshot;
+
     int subtree_index;
+    // the leaves of the siblings before this node in display order
+    int leaf_offset;
+    
+    template <class Writer> void write_node_fields_json(Writer &json, bool root) const {
+        json.key("i").value(id);
+        if (name.size() > 0) json.key("n").value(name);
+        
+        json.key("s").value(total_leaves);
+        if (leaf_offset > 0 && !root) json.key("o").value(leaf_offset);
+            
+        if (subtree_index > 0) {
+            json.key("subtree_index").value(subtree_index);
+        }
+    }
+    
+    template <class Writer>
+    static void write_parents_json(Writer &json, const std::map<int, int> &parent_map) {
+        json.key("parents");
+        json.begin('{');
+        for(std::map<int, int>::const_iterator itr = parent_map.begin();
+            itr != parent_map.end(); ++itr)
+            json.key(to_string(itr->first)).value(itr->second);
+        json.end('}');
+    }
+    
+    template <class Writer>
+    void write_lod_content_json(Writer &json, int depth_left, int min_leaves,
+            int subtree_id, std::map<int, int> &parent_map) const {
+        json.begin('{');
+        // only the root is not in the parents map yet
+        write_node_fields_json(json, parent_map.empty());
+        
+        if (children.size() > 0) {
+            int n_small = 0, small_leaves = 0, small_nodes = 0, large_leaves = 0;
+            for (const_iterator itr = children.begin(); itr != children.end(); ++itr) {
+                if (depth_left <= 0 || itr->total_leaves < min_leaves) {
+                    n_small++;
+                    small_leaves += itr->total_leaves;
+                    small_nodes += itr->total_nodes;
+                }
+                else large_leaves += itr->total_leaves;
+            }
+            // a lone leaf is smaller than its aggregate
+            const bool collapse = small_nodes > 1;
+            
+            json.key("c");
+            json.begin('[');
+            for (const_iterator itr = children.begin(); itr != children.end(); ++itr) {
+                if (collapse && (depth_left <= 0 || itr->total_leaves < min_leaves)) continue;
+                parent_map[itr->id] = id;
+                itr->write_lod_content_json(json, depth_left - 1, min_leaves, subtree_id, parent_map);
+            }
+            if (collapse) {
+                // the small children are the last ones in display order
+                json.begin('{');
+                json.key("s").value(small_leaves);
+                if (large_leaves > 0) json.key("o").value(large_leaves);
+                json.key("g").begin('{')
+                    .key("k").value(n_small)
+                    .key("t").value(small_nodes)
+                    .key("f").value(subtree_id)
+                .end('}');
+                json.end('}');
+            }
+            json.end(']');
+        }
+        json.end('}');
+    }
 
     void init(int &global_id) {
         id = global_id++;
         total_leaves = 0;
         total_nodes = 1;
         subtree_index = 0;
+        leaf_offset = 0;
     }
-
-    TreeOfLife(int &global_id) { init(global_id); }
     
-    void read_newick(std::istream &is, int depth, int &global_id) {
+    /**
+     * Puts the children in display order, the most leaves first, then by
+     * name with the unnamed last, and sets their leaf offsets
+     */
+    void sort_children() {
+        children.sort(display_order);
+        int offset = 0;
+        for (std::list<TreeOfLife>::iterator c = children.begin(); c != children.end(); ++c) {
+            c->leaf_offset = offset;
+            offset += c->total_leaves;
+        }
+    }
+    
+    static bool display_order(const TreeOfLife &a, const TreeOfLife &b) {
+        if (a.total_leaves != b.total_leaves) return a.total_leaves > b.total_leaves;
+        if (a.name.empty() || b.name.empty()) return !a.name.empty() && b.name.empty();
+        return a.name < b.name;
+    }
+
+    void parse_newick(const char *newick, size_t size, int global_id) {
+        init(global_id);
+        NewickReader reader(newick, size);
+        read_newick(reader, 0, global_id);
+    }
+
+    void read_newick(NewickReader &reader, int depth, int &global_id) {
         
-        if (is.peek() == '(') {
-            is.ignore();
+        if (reader.peek() == '(') {
+            reader.get();
             while (true) {
-                children.push_back(TreeOfLife(global_id));
-                TreeOfLife &child = children.back();
+                TreeOfLife &child = children.emplace_back(global_id);
                 
-                child.read_newick(is, depth+1, global_id);
+                child.read_newick(reader, depth+1, global_id);
                 
                 total_leaves += child.total_leaves;
                 total_nodes += child.total_nodes;
                 
-                char c = is.get();
+                char c = reader.get();
                 if (c == ',') continue;
                 if (c == ')') break;
                 throw error("unexpected token "+std::string(1, c));
             }
+            sort_children();
         } else {
             total_leaves = 1;
         }
         
-        set_name(read_newick_string(is));
+        set_name(reader.read_name());
         
-        if (depth == 0 && is.peek() == ';') is.ignore();
-    }
-    
-    std::string read_newick_string(std::istream &is) {
-        std::ostringstream oss;
-        bool quoted = is.peek() == '\'';
-        bool last_quote = false;
-        
-        if (quoted) is.ignore();
-        while (true) {
-            char c = is.peek();
-            
-            if (c == '\'') {
-                if (!quoted) throw error("unexpected quote after "+oss.str());
-                if (!last_quote) {
-                    last_quote = true;
-                    is.ignore();
-                    continue;
-                }
-                last_quote = false;
-            }
-            if (((last_quote || !quoted) && (c == ',' || c == ')' || c == ';')) || is.eof()) return oss.str();
-            else if (last_quote) throw error("expected quote after "+oss.str());
-            
-            if (c == '_') c = ' ';
-            oss << c;
-            is.ignore();
-        }
-        throw error("unexpected eof");
+        if (depth == 0 && reader.peek() == ';') reader.get();
     }
     
     void set_name(std::string name_) {
         // drop leading whitespace
-        while(name_.size() > 0 && name_[0] == ' ') name_ = name_.substr(1);
-        name = name_;
+        name_.erase(0, std::min(name_.find_first_not_of(' '), name_.size()));
 
-        int id_begin = name.find_last_of(' ');
+        const size_t id_begin = name_.find_last_of(' ');
 
         // detect id-only nodes
-        if (id_begin < 0) name.clear();
-        if (name.size() == 0) return;
+        if (id_begin == std::string::npos || name_.empty()) {
+            name.clear();
+            return;
+        }
 
-        name = name_.substr(0,id_begin);
-        ext_id = name_.substr(id_begin+1);
+        ext_id.assign(name_, id_begin+1, std::string::npos);
+        name_.resize(id_begin);
+        name = std::move(name_);
 
-        if (ext_id.substr(0,3) != std::string("ott"))
+        if (ext_id.compare(0, 3, "ott") != 0)
             throw error("expected ott+number, not "+ext_id);
         
         if (name.size() == 0) throw error("empty name");
         if (ext_id.size() == 0) throw error("empty ext_id");
     }
     
-    void write_content_json(JsonWriter &json) const {
-        json.begin('{');
-        
-        json.key("i").value(id);
-        if (name.size() > 0) json.key("n").value(name);
-        
-        if (total_leaves > 1) json.key("s").value(total_leaves);
-            
-        if (subtree_index > 0) {
-            json.key("subtree_index").value(subtree_index);
-        }
-        
-        if (children.size() > 0) {
-            
-            json.key("c");
-            json.begin('[');
-            for (const_iterator itr = children.begin();
-                itr != children.end();
-                ++itr)
-                itr->write_content_json(json);
-                    
-            json.end(']');
-        }
-        json.end('}');
-    }
-    
     void generate_parent_map(std::map<int, int>& parent_map, int parent_id = -1) const {
         if (parent_id != -1) parent_map[id] = parent_id;
         for (const_iterator itr = children.begin();
@@ -223,34 +432,93 @@ private:
             itr->generate_parent_map(parent_map, id);
     }
     
-    void decompose(std::list<TreeOfLife> &out,
-                    const int max_subtree_size,
-                    int overlap_depth = 0) {
+    /** Clades at least this large are searched as separate tasks */
+    static const int PARALLEL_GRAIN = 10000;
+    
+    /** A clade to split off, depth levels below the root being decomposed */
+    struct Split {
+        TreeOfLife *node;
+        int depth;
+        // where it is copied in the output, and its id
+        TreeOfLife *copy;
+        int subtree_id;
+    };
+    
+    /**
+     * The clades to split off below a node in preorder, where the part
+     * below a child searched by another task is a nested list
+     */
+    class SplitList {
+    public:
+        void add(TreeOfLife *node, int depth) {
+            entries.emplace_back();
+            entries.back().split.node = node;
+            entries.back().split.depth = depth;
+        }
         
-        const int MAX_OVERLAP_DEPTH = 1;
-        const int MIN_SUBTREE_SIZE = 10000;
+        SplitList *add_nested() {
+            entries.emplace_back();
+            entries.back().nested.reset(new SplitList());
+            return entries.back().nested.get();
+        }
         
-        if (overlap_depth == 0) {
-            if (total_nodes <= max_subtree_size &&
-                total_nodes >= MIN_SUBTREE_SIZE) {
-            
-                overlap_depth = 1;
-                out.push_back(*this); // deep copy
-                subtree_index = out.size();
+        /** Appends the clades in preorder */
+        void flatten(std::vector<Split> &splits) const {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (entries[i].nested) entries[i].nested->flatten(splits);
+                else splits.push_back(entries[i].split);
             }
         }
-        else {
-            if (overlap_depth >= MAX_OVERLAP_DEPTH) {
-                children.clear();
-                return;
+        
+    private:
+        struct Entry {
+            Split split;
+            std::unique_ptr<SplitList> nested;
+        };
+        std::vector<Entry> entries;
+    };
+    
+    /**
+     * Finds the largest clades below this node that are small enough to be
+     * split off, spawning a task for each large child
+     */
+    void find_splits(const int max_subtree_size, const DecompositionParams &params,
+                     WorkStealingScheduler &scheduler, int worker, int depth, SplitList &list) {
+        if (total_nodes <= max_subtree_size && total_nodes >= params.min_subtree_size) {
+            list.add(this, depth);
+            return;
+        }
+        for (std::list<TreeOfLife>::iterator itr = children.begin(); itr != children.end(); ++itr) {
+            if (itr->total_nodes >= PARALLEL_GRAIN && scheduler.threads() > 1) {
+                TreeOfLife *child = &*itr;
+                SplitList *nested = list.add_nested();
+                scheduler.spawn([child, nested, max_subtree_size, depth, &params, &scheduler](int w) {
+                    child->find_splits(max_subtree_size, params, scheduler, w, depth + 1, *nested);
+                }, worker);
             }
-            overlap_depth++;
+            else itr->find_splits(max_subtree_size, params, scheduler, worker, depth + 1, list);
         }
-        
-        for(std::list<TreeOfLife>::iterator itr = children.begin();
-                itr != children.end();
-                itr++) 
-            itr->decompose(out, max_subtree_size, overlap_depth);
+    }
+    
+    /** Keeps max_overlap_depth levels of a split-off clade in its parent subtree */
+    void trim_overlap(int overlap_depth, int max_overlap_depth) {
+        for (std::list<TreeOfLife>::iterator itr = children.begin(); itr != children.end(); ++itr) {
+            if (overlap_depth >= max_overlap_depth) itr->children.clear();
+            else itr->trim_overlap(overlap_depth + 1, max_overlap_depth);
+        }
+    }
+    
+    static void add_prefetch_hints(std::vector<PrefetchHint> &split,
+                                   const DecompositionParams &params,
+                                   std::vector<PrefetchHint> &hints) {
+        const size_t n = std::min(split.size(), size_t(std::max(0, params.max_prefetch_hints)));
+        std::partial_sort(split.begin(), split.begin() + n, split.end(), more_likely);
+        hints.assign(split.begin(), split.begin() + n);
+    }
+    
+    static bool more_likely(const PrefetchHint &a, const PrefetchHint &b) {
+        if (a.weight() != b.weight()) return a.weight() > b.weight();
+        return a.subtree_id < b.subtree_id;
     }
 };
 
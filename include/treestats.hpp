@@ -0,0 +1,242 @@
+#ifndef __TREESTATS_HPP
+#define __TREESTATS_HPP
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <tree.hpp>
+
+/** Counts of values in the buckets 0, 1, 2-3, 4-7, 8-15, ... */
+class Histogram {
+public:
+    long long count, sum, min, max;
+
+    Histogram() : count(0), sum(0), min(0), max(0) {}
+
+    void add(long long value) {
+        if (count == 0 || value < min) min = value;
+        if (count == 0 || value > max) max = value;
+        count++;
+        sum += value;
+
+        const size_t bucket = value > 0 ? 64 - __builtin_clzll(value) : 0;
+        if (buckets.size() <= bucket) buckets.resize(bucket + 1, 0);
+        buckets[bucket]++;
+    }
+
+    /** {"count": n, "min": .., "max": .., "mean": .., "buckets": [[low, high, n], ...]} */
+    template <class Writer> void write_json(Writer &json) const {
+        json.begin('{')
+            .key("count").value(count)
+            .key("min").value(min)
+            .key("max").value(max)
+            .key("mean").value(count > 0 ? double(sum) / count : 0.0);
+
+        json.key("buckets").begin('[');
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            if (buckets[b] == 0) continue;
+            const long long low = b > 0 ? 1LL << (b - 1) : 0;
+            json.begin('[')
+                .value(low)
+                .value(b > 0 ? 2 * low - 1 : 0LL)
+                .value(buckets[b])
+            .end(']');
+        }
+        json.end(']');
+        json.end('}');
+    }
+
+private:
+    std::vector<long long> buckets;
+};
+
+/**
+ * The shape of a tree for tuning the decomposition: depths, fan-outs,
+ * clade sizes and names, collected in one traversal. The names are not
+ * copied, so the tree must outlive the statistics.
+ */
+class TreeStats {
+public:
+    typedef TreeOfLife::DecompositionParams DecompositionParams;
+
+    TreeStats(const TreeOfLife &tree) :
+        n_nodes(0), n_leaves(0), n_unary(0), n_named(0),
+        n_non_ascii_names(0), n_non_ascii_bytes(0)
+    {
+        name_counts.reserve(tree.total_nodes);
+        visit(tree, 0);
+    }
+
+    template <class Writer> void write_json(Writer &json) const {
+        json.begin('{')
+            .key("nodes").value(n_nodes)
+            .key("leaves").value(n_leaves)
+            .key("unary_nodes").value(n_unary);
+
+        json.key("depth").begin('{');
+        json.key("leaves").value(leaf_depth);
+        json.key("nodes_by_depth").begin('[');
+        for (size_t d = 0; d < nodes_by_depth.size(); ++d) json.value(nodes_by_depth[d]);
+        json.end(']');
+        json.end('}');
+
+        json.key("fan_out").value(fan_out);
+        json.key("clade_leaves").value(clade_leaves);
+
+        // the most frequent duplicates first, ties by name
+        std::vector< std::pair<int, const std::string*> > duplicates;
+        long long n_duplicated_nodes = 0;
+        for (NameCounts::const_iterator itr = name_counts.begin(); itr != name_counts.end(); ++itr) {
+            if (itr->second < 2) continue;
+            duplicates.push_back(std::make_pair(-itr->second, itr->first));
+            n_duplicated_nodes += itr->second;
+        }
+        const size_t n_top = std::min(duplicates.size(), size_t(MAX_DUPLICATES_LISTED));
+        std::partial_sort(duplicates.begin(), duplicates.begin() + n_top, duplicates.end(),
+            more_duplicated);
+
+        json.key("names").begin('{')
+            .key("named").value(n_named)
+            .key("unnamed").value(n_nodes - n_named)
+            .key("bytes").value(name_bytes)
+            .key("code_points").value(name_code_points)
+            .key("non_ascii_names").value(n_non_ascii_names)
+            .key("non_ascii_bytes").value(n_non_ascii_bytes)
+            .key("distinct").value(int(name_counts.size()))
+            .key("duplicated").value(int(duplicates.size()))
+            .key("duplicated_nodes").value(n_duplicated_nodes);
+
+        json.key("most_duplicated").begin('[');
+        for (size_t i = 0; i < n_top; ++i)
+            json.begin('[').value(*duplicates[i].second).value(-duplicates[i].first).end(']');
+        json.end(']');
+        json.end('}');
+
+        json.end('}');
+    }
+
+    /**
+     * The number of nodes in each subtree document that
+     * iterative_decomposition would write, indexed by subtree id, without
+     * copying the tree
+     */
+    static std::vector<int> decomposition_sizes(const TreeOfLife &tree,
+                                                const DecompositionParams &params) {
+        std::vector<int> sizes(1, tree.total_nodes);
+
+        typedef std::pair<const TreeOfLife*, size_t> Root;
+        std::vector<Root> roots(1, Root(&tree, 0));
+
+        for (size_t itr = 0; itr < params.max_subtree_sizes.size(); ++itr) {
+            const int max_subtree_size = params.max_subtree_sizes[itr];
+            std::vector<Root> new_roots;
+
+            for (size_t i = 0; i < roots.size(); ++i) {
+                if (roots[i].first->total_nodes <= max_subtree_size) continue;
+
+                std::vector<const TreeOfLife*> split;
+                find_split_roots(*roots[i].first, max_subtree_size, params, split);
+
+                const size_t first_id = sizes.size();
+                for (size_t j = 0; j < split.size(); ++j) {
+                    // the parent keeps the top levels of the split-off clade
+                    sizes[roots[i].second] -= split[j]->total_nodes -
+                        nodes_within(*split[j], std::max(1, params.max_overlap_depth));
+                    sizes.push_back(split[j]->total_nodes);
+                }
+                // iterative_decomposition continues from the last one
+                for (size_t j = split.size(); j > 0; --j)
+                    new_roots.push_back(Root(split[j-1], first_id + j - 1));
+            }
+            roots = new_roots;
+        }
+        return sizes;
+    }
+
+private:
+    static const int MAX_DUPLICATES_LISTED = 20;
+
+    struct NameHash {
+        size_t operator()(const std::string *name) const { return std::hash<std::string>()(*name); }
+    };
+    struct NameEqual {
+        bool operator()(const std::string *a, const std::string *b) const { return *a == *b; }
+    };
+    typedef std::unordered_map<const std::string*, int, NameHash, NameEqual> NameCounts;
+
+    long long n_nodes, n_leaves, n_unary, n_named, n_non_ascii_names, n_non_ascii_bytes;
+    std::vector<long long> nodes_by_depth;
+    Histogram leaf_depth, fan_out, clade_leaves, name_bytes, name_code_points;
+    NameCounts name_counts;
+
+    void visit(const TreeOfLife &node, size_t depth) {
+        n_nodes++;
+        if (nodes_by_depth.size() <= depth) nodes_by_depth.resize(depth + 1, 0);
+        nodes_by_depth[depth]++;
+
+        if (node.children.empty()) {
+            n_leaves++;
+            leaf_depth.add(depth);
+        }
+        else {
+            if (node.children.size() == 1) n_unary++;
+            fan_out.add(node.children.size());
+            clade_leaves.add(node.total_leaves);
+        }
+
+        if (!node.name.empty()) visit_name(node.name);
+
+        for (TreeOfLife::const_iterator c = node.children.begin(); c != node.children.end(); ++c)
+            visit(*c, depth + 1);
+    }
+
+    void visit_name(const std::string &name) {
+        n_named++;
+        name_counts[&name]++;
+
+        long long code_points = 0, non_ascii = 0;
+        for (size_t i = 0; i < name.size(); ++i) {
+            const unsigned char c = name[i];
+            if (c >= 0x80) non_ascii++;
+            // continuation bytes are 10xxxxxx
+            if ((c & 0xc0) != 0x80) code_points++;
+        }
+        name_bytes.add(name.size());
+        name_code_points.add(code_points);
+        if (non_ascii > 0) n_non_ascii_names++;
+        n_non_ascii_bytes += non_ascii;
+    }
+
+    static bool more_duplicated(const std::pair<int, const std::string*> &a,
+                                const std::pair<int, const std::string*> &b) {
+        if (a.first != b.first) return a.first < b.first;
+        return *a.second < *b.second;
+    }
+
+    /** The clades that decompose splits off below node */
+    static void find_split_roots(const TreeOfLife &node, int max_subtree_size,
+                                 const DecompositionParams &params,
+                                 std::vector<const TreeOfLife*> &split) {
+        if (node.total_nodes <= max_subtree_size && node.total_nodes >= params.min_subtree_size) {
+            split.push_back(&node);
+            return;
+        }
+        for (TreeOfLife::const_iterator c = node.children.begin(); c != node.children.end(); ++c)
+            find_split_roots(*c, max_subtree_size, params, split);
+    }
+
+    /** The nodes at most depth levels below node, including it */
+    static int nodes_within(const TreeOfLife &node, int depth) {
+        int n = 1;
+        if (depth > 0) {
+            for (TreeOfLife::const_iterator c = node.children.begin(); c != node.children.end(); ++c)
+                n += nodes_within(*c, depth - 1);
+        }
+        return n;
+    }
+};
+
+#endif
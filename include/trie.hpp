@@ -1,8 +1,10 @@
 #ifndef __TRIE_HPP
 #define __TRIE_HPP
 
+#include <functional>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <map>
 #include <list>
 #include <stdexcept>
@@ -13,59 +15,56 @@
 template <class Value>
 class UnicodeTrie {
 public:
-    std::map<Utf8::CodePoint, UnicodeTrie> children;
+    // std::less<> finds code points given as string views without copying them
+    typedef std::map<Utf8::CodePoint, UnicodeTrie, std::less<> > Children;
+    Children children;
     
     bool has_value;
     Value value;
 
-    typedef typename std::map<Utf8::CodePoint, UnicodeTrie<Value> >::const_iterator const_iterator;
+    typedef typename Children::const_iterator const_iterator;
 
-    void insert(std::string encoded_key, Value value, bool replace = false) {
-        Utf8::String key = Utf8::decode(encoded_key.c_str());
-        Utf8::String::const_iterator itr = key.begin();
-        UnicodeTrie<Value> &where = lookup_subtree(itr, key.end());
-        where.insert_subtree(itr, key.end(), value, replace);
+    void insert(std::string_view encoded_key, const Value &value, bool replace = false) {
+        // validate first, the trie is not changed on errors
+        Utf8::check(encoded_key);
+        UnicodeTrie &where = lookup_subtree(encoded_key);
+        where.insert_subtree(encoded_key, value, replace);
     }
     
-    const Value *lookup(std::string encoded_key) {
-        Utf8::String key = Utf8::decode(encoded_key.c_str());
-        Utf8::String::const_iterator itr = key.begin();
-        UnicodeTrie<Value> &where = lookup_subtree(itr, key.end());
-        if (itr != key.end() || !where.has_value) return NULL;
+    const Value *lookup(std::string_view encoded_key) {
+        UnicodeTrie &where = lookup_subtree(encoded_key);
+        if (!encoded_key.empty() || !where.has_value) return NULL;
         return &(where.value);
     }
     
-    const Value &get(std::string key) {
+    const Value &get(std::string_view key) {
         const Value *s = lookup(key);
         if (s == NULL) throw std::runtime_error("not found");
         return *s;
     }
     
-    UnicodeTrie<Value>() : has_value(false) {}
+    UnicodeTrie() : has_value(false), value() {}
     
 private:
-    typedef typename std::map<Utf8::CodePoint, UnicodeTrie<Value> >::iterator iterator;
+    typedef typename Children::iterator iterator;
 
-    UnicodeTrie<Value> &lookup_subtree(
-        Utf8::String::const_iterator &key, 
-        Utf8::String::const_iterator key_end) {
+    /** The deepest node on the path of key, removes the path from key */
+    UnicodeTrie &lookup_subtree(std::string_view &key) {
         
-        if (key == key_end) return *this;
+        if (key.empty()) return *this;
         
-        iterator itr = children.find(*key);
+        const size_t length = Utf8::first_length(key);
+        iterator itr = children.find(key.substr(0, length));
         if (itr != children.end()) {
-            key++;
-            return itr->second.lookup_subtree(key, key_end);
+            key.remove_prefix(length);
+            return itr->second.lookup_subtree(key);
         }
         return *this;
     }
     
-    void insert_subtree(
-        Utf8::String::const_iterator key,
-        Utf8::String::const_iterator key_end,
-        const Value &new_v, bool replace) {
+    void insert_subtree(std::string_view key, const Value &new_v, bool replace) {
         
-        if (key == key_end) {
+        if (key.empty()) {
             if (!replace && has_value)
                 throw std::runtime_error("key already exists in trie");
             value = new_v;
@@ -73,8 +72,9 @@ private:
             return;
         }
         
-        children[*key] = UnicodeTrie<Value>();
-        children.find(*key)->second.insert_subtree(key+1, key_end, new_v, replace);
+        const size_t length = Utf8::first_length(key);
+        UnicodeTrie &child = children.try_emplace(Utf8::CodePoint(key.substr(0, length))).first->second;
+        child.insert_subtree(key.substr(length), new_v, replace);
     }
 };
 
@@ -91,7 +91,7 @@ public:
     
     bool empty() const { return !has_value && children.size() == 0; }
     
-    StringTrie<Value>() : has_value(false), total_nodes(1) {}
+    StringTrie() : value(), has_value(false), total_nodes(1) {}
     
     void copy_char_trie(const UnicodeTrie<Value> &char_trie) {
         value = char_trie.value;
@@ -99,7 +99,19 @@ public:
         add_children(char_trie);
     }
     
-    void write_json(JsonWriter &json) const {
+    /**
+     * Compresses the character trie behind the edge key and appends it to
+     * the children of this node. Calling this for each child of a char trie
+     * in order is equivalent to copy_char_trie.
+     */
+    void add_compressed_child(const Utf8::CodePoint &key, const UnicodeTrie<Value> &child) {
+        std::string edge = key;
+        children.emplace_back();
+        add_child(child, children.back(), edge);
+        total_nodes += children.back().second.total_nodes;
+    }
+    
+    template <class Writer> void write_json(Writer &json) const {
         json.begin('{');
         
         if (children.size() > 0) {
@@ -126,23 +138,17 @@ private:
 
     void add_children(const UnicodeTrie<Value> &char_trie) {
         for (typename UnicodeTrie<Value>::const_iterator itr = char_trie.children.begin();
-            itr != char_trie.children.end(); ++itr) {
-            
-            std::ostringstream edge;
-            children.push_back(KeyValuePair("", StringTrie<Value>()));
-            edge << itr->first;
-            add_child(itr->second, children.back(), edge);
-            total_nodes += children.back().second.total_nodes;
-        }
+            itr != char_trie.children.end(); ++itr)
+            add_compressed_child(itr->first, itr->second);
     }
 
-    void add_child(const UnicodeTrie<Value> &child, KeyValuePair& kv_pair, std::ostringstream &edge) {
+    void add_child(const UnicodeTrie<Value> &child, KeyValuePair& kv_pair, std::string &edge) {
         if (child.children.size() == 1 && !child.has_value) {
-            edge <<  child.children.begin()->first;
+            edge += child.children.begin()->first;
             add_child(child.children.begin()->second, kv_pair, edge);
         }
         else {
-            kv_pair.first = edge.str();
+            kv_pair.first = std::move(edge);
             kv_pair.second.copy_char_trie(child);
         }
     }
@@ -1,8 +1,10 @@
 #ifndef __UTF8_HPP
 #define __UTF8_HPP
 
-#include <vector>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <vector>
  
 typedef unsigned char uint8_t;
 typedef unsigned int uint32_t;
@@ -70,27 +72,45 @@ public:
     // unicode string represented as a vector of Utf8CodePoints
     typedef std::vector<CodePoint> String;
 
-    static String decode(const char *str) {
+    static String decode(std::string_view str) {
+        String utf8string;
+        while (!str.empty()) {
+            const size_t length = first_length(str);
+            utf8string.emplace_back(str.substr(0, length));
+            str.remove_prefix(length);
+        }
+        return utf8string;
+    }
+    
+    // the first code point of a non-empty string
+    static CodePoint first(std::string_view str) {
+        if (str.empty()) throw std::runtime_error("empty string");
+        return CodePoint(str.substr(0, first_length(str)));
+    }
+    
+    // throws unless the string is well-formed UTF-8
+    static void check(std::string_view str) {
         
         uint32_t codepoint;
         uint32_t state = 0;
         
-        String utf8string;
-        
-        std::ostringstream oss;
-
-        for (; *str; ++str) {
-            oss << *str;
-            if (!decode_dfa(&state, &codepoint, *((unsigned char*)str))) {
-                utf8string.push_back(oss.str());
-                oss.str("");
-            }
-        }
-
+        for (size_t i = 0; i < str.size() && state != UTF8_REJECT; ++i)
+            decode_dfa(&state, &codepoint, (unsigned char)str[i]);
         if (state != UTF8_ACCEPT)
             throw std::runtime_error("input was not well-formed UTF-8");
+    }
+    
+    // the length in bytes of the first code point of a non-empty string
+    static size_t first_length(std::string_view str) {
         
-        return utf8string;
+        uint32_t codepoint;
+        uint32_t state = 0;
+        
+        for (size_t i = 0; i < str.size(); ++i) {
+            if (!decode_dfa(&state, &codepoint, (unsigned char)str[i])) return i + 1;
+            if (state == UTF8_REJECT) break;
+        }
+        throw std::runtime_error("input was not well-formed UTF-8");
     }
 };
 
@@ -26,6 +26,11 @@
  * some node in the tree. The member c can also be empty if query if is not
  * a proper prefix of any other node in the tree.
  * 
+ * If the index was built with ranked completions (bin/main --top-k K),
+ * search_model.completions(resultTrieNode) gives the names starting with
+ * the query with the most leaves first, as [suffix, [node id, subtree id]]
+ * pairs, without fetching more of the index.
+ * 
  */
 function SearchModel(search_ready_callback) {
     
@@ -40,7 +45,7 @@ function SearchModel(search_ready_callback) {
             callback(subtrees[id]);
         }
         else {
-            d3.json('data/search-'+id+'.json', function (error, data) {
+            data_source.json('search-'+id, function (error, data) {
                 if (error) return console.warn(error);
                 subtrees[id] = data;
                 callback(data);
@@ -53,9 +58,71 @@ function SearchModel(search_ready_callback) {
         if (search_ready_callback) search_ready_callback();
     });
     
+    this.ranked = function () { return !!root.t; }
+    
+    this.completions = function (tree) {
+        if (tree.t) {
+            return tree.t.map(function (t) { return [t[0], [t[1], t[2]]]; });
+        }
+        
+        // a node with at most K names below, all in the same file
+        var found = [];
+        (function collect(node, suffix) {
+            if (node.v) found.push([suffix, node.v]);
+            for (var key in node.c) collect(node.c[key], suffix + key);
+        })(tree, '');
+        
+        found.sort(function (a, b) {
+            var wa = a[1][2] || 1, wb = b[1][2] || 1;
+            if (wa != wb) return wb - wa;
+            return a[0] < b[0] ? -1 : (a[0] > b[0] ? 1 : 0);
+        });
+        return found;
+    }
+    
+    function utf8Bytes(str) {
+        var bytes = unescape(encodeURIComponent(str));
+        var codes = [];
+        for (var i = 0; i < bytes.length; i++) codes.push(bytes.charCodeAt(i));
+        return codes;
+    }
+    
+    /**
+     * False if no name in the subtree starts with prefix, by the Bloom
+     * filter b of its prefixes of at most b.l code points (see BloomFilter
+     * in bloom.hpp for the hashes)
+     */
+    function mayContain(b, prefix) {
+        var bytes;
+        try {
+            bytes = utf8Bytes(prefix);
+        } catch (e) {
+            return true; // e.g., a lone surrogate
+        }
+        if (!b.bits) b.bits = atob(b.f);
+        
+        var h1 = 2166136261, h2 = 0x5bd1e995, length = 0;
+        for (var i = 0; i < bytes.length && length < b.l; i++) {
+            h1 = Math.imul(h1 ^ bytes[i], 16777619) >>> 0;
+            h2 = Math.imul(h2 ^ bytes[i], 16777619) >>> 0;
+            // the prefix ends with a code point unless a continuation byte follows
+            if (i + 1 < bytes.length && (bytes[i+1] & 0xc0) == 0x80) continue;
+            length++;
+            for (var k = 0; k < b.k; k++) {
+                var bit = ((h1 + Math.imul(k, h2 | 1)) >>> 0) % b.m;
+                if (!(b.bits.charCodeAt(bit >> 3) & (1 << (bit & 7)))) return false;
+            }
+        }
+        return true;
+    }
+    
     function doSearch(tree, prefix, callback) {
     
         if (tree.subtree_index) {
+            if (prefix !== '' && tree.b && !mayContain(tree.b, prefix)) {
+                callback(null);
+                return;
+            }
             fetch(tree.subtree_index, function (subtree) {
                 doSearch(subtree, prefix, callback);
             });
@@ -73,8 +140,14 @@ function SearchModel(search_ready_callback) {
                 return;
             }
             if (key.indexOf(prefix) == 0) {
+                var rest = key.substring(prefix.length);
                 var new_tree = { c: {} };
-                new_tree.c[key.substring(prefix.length)] = tree.c[key];
+                new_tree.c[rest] = tree.c[key];
+                if (tree.c[key].t) {
+                    new_tree.t = tree.c[key].t.map(function (t) {
+                        return [rest + t[0], t[1], t[2]];
+                    });
+                }
                 callback(new_tree);
                 return;
             }
@@ -136,6 +209,7 @@ function SearchView(result_callback) {
         checkLoader();
         
         var keys = [];
+        var ranked = [];
         go_button_action = null;
         
         function onLineClick(l) {
@@ -146,18 +220,30 @@ function SearchView(result_callback) {
                 if (selected.v) openResult(selected.v);
             }
         }
+        
+        function onCompletionClick(completion) {
+            search_area.property('value', capitalize(query+completion[0]));
+            searchFor(capitalize(query+completion[0]));
+            openResult(completion[1]);
+            results_area.classed('hidden', true);
+        }
             
         if (result === null) {
             keys = [];
             
         } else {
             keys = d3.keys(result.c);
+            if (model.ranked()) ranked = model.completions(result);
             
             if (result.v) {
                 go_button_action = (function () {
                     openResult(result.v);
                     results_area.classed('hidden', true);
                 });
+            } else if (ranked.length == 1) {
+                go_button_action = (function () {
+                    onCompletionClick(ranked[0]);
+                });
             } else if (keys.length == 1) {
                 go_button_action = (function () {
                     onLineClick(keys[0]);
@@ -178,13 +264,17 @@ function SearchView(result_callback) {
         
         var data = [];
         
-        keys.sort();
-        for (var i in keys) {
-            var key = keys[i];
-            data.push(key);
-            if (i > 10) {
-                data.push('...');
-                break;
+        if (ranked.length > 0) {
+            data = ranked;
+        } else {
+            keys.sort();
+            for (var i in keys) {
+                var key = keys[i];
+                data.push(key);
+                if (i > 10) {
+                    data.push('...');
+                    break;
+                }
             }
         }
         
@@ -197,11 +287,17 @@ function SearchView(result_callback) {
             .attr('class', 'result-line')
             .attr('href', 'javascript:void(0)');
         
-        lines.on('click', function (l) { onLineClick(l); });
+        lines.on('click', function (l) {
+            if (ranked.length > 0) onCompletionClick(l);
+            else onLineClick(l);
+        });
             
         lines.exit().remove();
         
-        lines.text(function(v) {return capitalize(query+v)});
+        lines.text(function(v) {
+            if (ranked.length > 0) return capitalize(query+v[0]);
+            return capitalize(query+v);
+        });
     }
     
     go_button
@@ -0,0 +1,369 @@
+#include <tree.hpp>
+#include <json.hpp>
+#include <output.hpp>
+#include <async_output.hpp>
+#include <snapshot.hpp>
+#include <synthetic.hpp>
+#include <newick.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Micro-benchmarks of the phases of bin/main. The tree is read from a
+ * snapshot or a Newick file or generated at random; each benchmark prints
+ * one JSON object per configuration to stdout.
+ */
+struct Options {
+    std::string snapshot_in, newick_in, directory;
+    int nodes, repeat, max_threads;
+    std::vector<std::string> benchmarks;
+    // smaller than in bin/main, so that the default tree gives ~1800 files
+    TreeOfLife::DecompositionParams decomposition;
+
+    Options() : directory("bin/"), nodes(500000), repeat(3),
+                max_threads(std::max(4, default_thread_count())) {
+        decomposition.max_subtree_sizes.clear();
+        decomposition.max_subtree_sizes.push_back(10000);
+        decomposition.max_subtree_sizes.push_back(2000);
+        decomposition.max_subtree_sizes.push_back(500);
+        decomposition.min_subtree_size = 100;
+    }
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--from-snapshot") snapshot_in = argv[++i];
+            else if (i + 1 < argc && arg == "--input") newick_in = argv[++i];
+            else if (i + 1 < argc && arg == "--nodes") nodes = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--repeat") repeat = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--dir") directory = argv[++i];
+            else if (i + 1 < argc && arg == "--threads") max_threads = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--max-subtree-sizes") {
+                if (!parse_sizes(argv[++i], decomposition.max_subtree_sizes)) return false;
+            }
+            else if (i + 1 < argc && arg == "--min-subtree-size")
+                decomposition.min_subtree_size = atoi(argv[++i]);
+            else if (arg == "write" || arg == "json" || arg == "scan" || arg == "decompose")
+                benchmarks.push_back(arg);
+            else return false;
+        }
+        if (nodes < 1 || repeat < 1 || max_threads < 1) return false;
+        if (directory.size() > 0 && directory[directory.size()-1] != '/') directory += "/";
+        if (benchmarks.empty()) {
+            benchmarks.push_back("json");
+            benchmarks.push_back("write");
+            benchmarks.push_back("scan");
+            benchmarks.push_back("decompose");
+        }
+        return true;
+    }
+
+    static bool parse_sizes(const std::string &list, std::vector<int> &sizes) {
+        sizes.clear();
+        std::istringstream iss(list);
+        std::string size;
+        while (std::getline(iss, size, ',')) {
+            sizes.push_back(atoi(size.c_str()));
+            if (sizes.back() < 1) return false;
+        }
+        return true;
+    }
+
+    static void usage(std::ostream &os) {
+        os << "usage: bin/bench [options] [BENCHMARK...]" << std::endl
+           << "  --from-snapshot FILE  benchmark on the tree in a snapshot" << std::endl
+           << "  --input FILE.tre      benchmark on the tree in a Newick file" << std::endl
+           << "  --nodes N             size of the random tree otherwise (default 500000)" << std::endl
+           << "  --repeat N            runs per configuration, the fastest is reported (default 3)" << std::endl
+           << "  --dir DIR             where temporary output files go (default bin/)" << std::endl
+           << "  --threads N           decompose with 1 to N threads (default 4 or the core count)" << std::endl
+           << "  --max-subtree-sizes N,N,...  decomposition of the tree into files" << std::endl
+           << "                        (default 10000,2000,500, bin/main uses 500000,100000,50000)" << std::endl
+           << "  --min-subtree-size N  smallest clade split off (default 100)" << std::endl
+           << "BENCHMARKs:" << std::endl
+           << "  json                  JSON tokens per second of each JsonWriter policy" << std::endl
+           << "  write                 formatting and writing the subtree files with each writer" << std::endl
+           << "  scan                  GB/s of the Newick structural index with each kernel" << std::endl
+           << "  decompose             iterative_decomposition with 1 to N threads" << std::endl;
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point begin) {
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+/** Flushes the files subtree-0.json ... of the directory and then the directory */
+void fsync_files(const std::string &prefix, size_t n_files) {
+    for (size_t i = 0; i <= n_files; ++i) {
+        const std::string filename = i < n_files ? prefix + "subtree-" + to_string(i) + ".json" : prefix;
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fsync(fd) != 0) throw std::runtime_error("could not fsync "+filename);
+        close(fd);
+    }
+}
+
+/** Formats all subtrees and writes them to a fresh directory, returns the seconds */
+double write_phase(const std::list<TreeOfLife> &subtrees, const Options &options,
+                   const std::string &writer, AsyncDirectorySink::FsyncPolicy fsync_policy,
+                   size_t &bytes) {
+    std::string directory = options.directory + "bench-XXXXXX";
+    if (mkdtemp(&directory[0]) == NULL) throw std::runtime_error("mkdtemp failed in "+options.directory);
+    const std::string prefix = directory + "/";
+
+    Clock::time_point begin = Clock::now();
+    {
+        std::unique_ptr<OutputSink> out;
+        if (writer == "ofstream") out.reset(new DirectorySink(prefix));
+        else out.reset(new AsyncDirectorySink(prefix, writer == "uring" ?
+            AsyncDirectorySink::IO_URING : AsyncDirectorySink::THREAD, fsync_policy));
+
+        std::ostringstream log;
+        bytes = 0;
+        int subtree_id = 0;
+        for (std::list<TreeOfLife>::const_iterator itr = subtrees.begin();
+            itr != subtrees.end(); ++itr, ++subtree_id) {
+            JsonWriter json;
+            itr->write_json(json);
+            const std::string payload = json.to_string();
+            bytes += payload.size();
+            out->write("subtree-"+to_string(subtree_id), payload);
+        }
+        out->finish();
+        if (writer == "ofstream" && fsync_policy == AsyncDirectorySink::FSYNC_END)
+            fsync_files(prefix, subtrees.size());
+    }
+    const double seconds = seconds_since(begin);
+
+    for (size_t i = 0; i < subtrees.size(); ++i)
+        std::remove((prefix + "subtree-" + to_string(i) + ".json").c_str());
+    rmdir(directory.c_str());
+    return seconds;
+}
+
+/** UncheckedJson that counts the tokens */
+class CountingJson : public UncheckedJson {
+public:
+    static long long tokens;
+    bool begin_token(Token token) {
+        tokens++;
+        return UncheckedJson::begin_token(token);
+    }
+};
+long long CountingJson::tokens = 0;
+
+void report_json(const char *policy, const char *buffer,
+                 long long tokens, size_t bytes, double seconds) {
+    JsonStreamWriter json(std::cout);
+    json.begin('{')
+        .key("benchmark").value("json")
+        .key("policy").value(policy)
+        .key("buffer").value(buffer)
+        .key("tokens").value(tokens)
+        .key("megabytes").value(bytes / 1e6)
+        .key("seconds").value(seconds)
+        .key("tokens_per_second").value(tokens / seconds)
+    .end('}');
+    std::cout << std::endl;
+}
+
+template <class Validation>
+void bench_json_policy(const TreeOfLife &tree, const Options &options,
+                       const char *policy, long long tokens) {
+    double best_string = 0, best_stream = 0;
+    size_t bytes = 0;
+    for (int r = 0; r < options.repeat; ++r) {
+        Clock::time_point begin = Clock::now();
+        BasicJsonWriter<Validation, JsonStringBuffer> json;
+        tree.write_content_json(json);
+        bytes = json.to_string().size();
+        double seconds = seconds_since(begin);
+        if (r == 0 || seconds < best_string) best_string = seconds;
+
+        begin = Clock::now();
+        std::ostringstream oss;
+        BasicJsonWriter<Validation, JsonStreamBuffer> stream_json(oss);
+        tree.write_content_json(stream_json);
+        seconds = seconds_since(begin);
+        if (r == 0 || seconds < best_stream) best_stream = seconds;
+    }
+    report_json(policy, "string", tokens, bytes, best_string);
+    report_json(policy, "stream", tokens, bytes, best_stream);
+}
+
+void bench_json(const TreeOfLife &tree, const Options &options) {
+    BasicJsonWriter<CountingJson, JsonStringBuffer> counter;
+    tree.write_content_json(counter);
+    const long long tokens = CountingJson::tokens;
+    bench_json_policy<CheckedJson>(tree, options, "checked", tokens);
+    bench_json_policy<UncheckedJson>(tree, options, "unchecked", tokens);
+}
+
+void bench_write(const TreeOfLife &tree, const Options &options, std::ostream &log) {
+    // the decomposition trims the tree, which the other benchmarks need whole
+    TreeOfLife copy = tree;
+    std::list<TreeOfLife> subtrees;
+    copy.iterative_decomposition(subtrees, options.decomposition);
+    log << "write: " << subtrees.size() << " subtrees" << std::endl;
+
+    const char *writers[] = { "ofstream", "thread", "uring" };
+    const char *policies[] = { "none", "end" };
+
+    for (int p = 0; p < 2; ++p) {
+        for (int w = 0; w < 3; ++w) {
+            const AsyncDirectorySink::FsyncPolicy policy =
+                AsyncDirectorySink::parse_fsync_policy(policies[p]);
+            double best = 0;
+            size_t bytes = 0;
+            for (int r = 0; r < options.repeat; ++r) {
+                double seconds = write_phase(subtrees, options, writers[w], policy, bytes);
+                if (r == 0 || seconds < best) best = seconds;
+            }
+
+            JsonStreamWriter json(std::cout);
+            json.begin('{')
+                .key("benchmark").value("write")
+                .key("writer").value(writers[w])
+                .key("fsync").value(policies[p])
+                .key("files").value(int(subtrees.size()))
+                .key("megabytes").value(bytes / 1e6)
+                .key("seconds").value(best)
+            .end('}');
+            std::cout << std::endl;
+        }
+    }
+}
+
+void report_scan(const char *stage, const char *kernel, size_t bytes, double seconds) {
+    JsonStreamWriter json(std::cout);
+    json.begin('{')
+        .key("benchmark").value("scan")
+        .key("stage").value(stage)
+        .key("kernel").value(kernel)
+        .key("megabytes").value(bytes / 1e6)
+        .key("seconds").value(seconds)
+        .key("gigabytes_per_second").value(bytes / seconds / 1e9)
+    .end('}');
+    std::cout << std::endl;
+}
+
+/** Times the structural index alone with each kernel, then the whole parse */
+void bench_scan(const std::string &newick, const Options &options) {
+    const NewickIndex::Kernel kernels[] = { NewickIndex::SCALAR, NewickIndex::SSE2, NewickIndex::AVX2 };
+    for (int k = 0; k < 3; ++k) {
+        if (!NewickIndex::supported(kernels[k])) continue;
+        double best = 0;
+        for (int r = 0; r < options.repeat; ++r) {
+            Clock::time_point begin = Clock::now();
+            NewickIndex index(newick.data(), newick.size(), kernels[k]);
+            double seconds = seconds_since(begin);
+            if (r == 0 || seconds < best) best = seconds;
+        }
+        report_scan("index", NewickIndex::kernel_name(kernels[k]), newick.size(), best);
+    }
+
+    double best = 0;
+    for (int r = 0; r < options.repeat; ++r) {
+        Clock::time_point begin = Clock::now();
+        TreeOfLife tree(newick.data(), newick.size());
+        double seconds = seconds_since(begin);
+        if (r == 0 || seconds < best) best = seconds;
+    }
+    report_scan("parse", NewickIndex::kernel_name(NewickIndex::best_kernel()), newick.size(), best);
+}
+
+/**
+ * Decomposes a fresh copy of the tree with each thread count; copying is not
+ * timed. Every run must give the same number of subtrees, more than one.
+ */
+void bench_decompose(const TreeOfLife &tree, const Options &options) {
+    double single = 0;
+    size_t n_subtrees = 0;
+    for (int t = 1; t <= options.max_threads; ++t) {
+        TreeOfLife::DecompositionParams params = options.decomposition;
+        params.n_threads = t;
+        double best = 0;
+        for (int r = 0; r < options.repeat; ++r) {
+            TreeOfLife copy = tree;
+            std::list<TreeOfLife> subtrees;
+            Clock::time_point begin = Clock::now();
+            copy.iterative_decomposition(subtrees, params);
+            double seconds = seconds_since(begin);
+            if (r == 0 || seconds < best) best = seconds;
+
+            if (t == 1 && r == 0) n_subtrees = subtrees.size();
+            if (n_subtrees < 2) throw std::runtime_error("decompose: the tree is not split, see --max-subtree-sizes");
+            if (subtrees.size() != n_subtrees)
+                throw std::runtime_error("decompose: "+to_string(subtrees.size())+" subtrees with "+
+                    to_string(t)+" threads, "+to_string(n_subtrees)+" with 1");
+        }
+        if (t == 1) single = best;
+
+        JsonStreamWriter json(std::cout);
+        json.begin('{')
+            .key("benchmark").value("decompose")
+            .key("threads").value(t)
+            .key("subtrees").value(int(n_subtrees))
+            .key("seconds").value(best)
+            .key("speedup").value(single / best)
+        .end('}');
+        std::cout << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    using std::endl;
+
+    std::ostream &log = std::cerr;
+
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(log);
+        return 1;
+    }
+
+    std::string newick;
+    if (options.newick_in.size() > 0) {
+        log << "reading " << options.newick_in << "..." << endl;
+        std::ifstream input(options.newick_in.c_str());
+        if (!input) throw std::runtime_error("cannot open "+options.newick_in);
+        newick = NewickReader::read_stream(input);
+    }
+    else if (options.snapshot_in.empty()) {
+        log << "generating a random tree of " << options.nodes << " nodes..." << endl;
+        newick = random_newick(options.nodes, 1);
+    }
+
+    std::unique_ptr<TreeOfLife> tree;
+    if (options.snapshot_in.size() > 0) {
+        log << "reading snapshot " << options.snapshot_in << "..." << endl;
+        TreeSnapshot snapshot(options.snapshot_in);
+        tree.reset(new TreeOfLife(snapshot.to_tree()));
+    }
+    else tree.reset(new TreeOfLife(newick.data(), newick.size()));
+
+    for (size_t i = 0; i < options.benchmarks.size(); ++i) {
+        if (options.benchmarks[i] == "json") bench_json(*tree, options);
+        if (options.benchmarks[i] == "write") bench_write(*tree, options, log);
+        if (options.benchmarks[i] == "decompose") bench_decompose(*tree, options);
+        if (options.benchmarks[i] == "scan") {
+            if (newick.empty()) log << "scan: needs a Newick tree, not a snapshot" << endl;
+            else bench_scan(newick, options);
+        }
+    }
+}
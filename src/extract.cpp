@@ -0,0 +1,110 @@
+#include <extract.hpp>
+#include <json.hpp>
+#include <tree.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Writes one clade of a Newick file, found by name or OTT id, as Newick
+ * or as a subtree JSON document, without parsing the rest of the file.
+ */
+struct Options {
+    std::string newick_in, query, output;
+    bool json;
+
+    Options() : json(false) {}
+
+    bool parse(int argc, char *argv[]) {
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--json") json = true;
+            else if (i + 1 < argc && arg == "--output") output = argv[++i];
+            else if (arg.size() > 1 && arg[0] == '-') return false;
+            else positional.push_back(arg);
+        }
+        if (positional.size() != 2) return false;
+        newick_in = positional[0];
+        query = positional[1];
+        return true;
+    }
+
+    static void usage(std::ostream &os) {
+        os << "usage: bin/extract [options] FILE.tre NAME|OTT_ID" << std::endl
+           << "  --json           write the subtree JSON of bin/main instead of Newick" << std::endl
+           << "  --output FILE    write to FILE instead of stdout" << std::endl
+           << "Names may use '_' or ' ', ids are given as ottN or N." << std::endl;
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point begin) {
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+int main(int argc, char *argv[]) {
+
+    using std::endl;
+
+    std::ostream &log = std::cerr;
+
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(log);
+        return 1;
+    }
+
+    Clock::time_point begin = Clock::now();
+    NewickClades clades(options.newick_in);
+    log << "indexed " << clades.bytes() / 1e6 << " MB in " << seconds_since(begin) << " s" << endl;
+
+    begin = Clock::now();
+    const std::vector<NewickClades::Clade> found = clades.find(options.query);
+    log << "searched in " << seconds_since(begin) << " s" << endl;
+
+    if (found.empty()) {
+        log << options.query << " not found" << endl;
+        return 1;
+    }
+    if (found.size() > 1) {
+        const size_t MAX_LISTED = 10;
+        log << found.size() << " clades named " << options.query
+            << ", writing the first, the others are";
+        for (size_t i = 1; i < found.size() && i <= MAX_LISTED; ++i) log << " " << found[i].ext_id;
+        if (found.size() > MAX_LISTED + 1) log << " ...";
+        log << endl;
+    }
+    const NewickClades::Clade &clade = found[0];
+    log << clade.name << " " << clade.ext_id << ": node " << clade.id << ", "
+        << (clade.end - clade.begin) / 1e6 << " MB of Newick" << endl;
+
+    std::unique_ptr<std::ofstream> file;
+    if (options.output.size() > 0) file.reset(new std::ofstream(options.output.c_str(), std::ios::binary));
+    std::ostream &out = file ? *file : std::cout;
+
+    begin = Clock::now();
+    std::string payload;
+    if (options.json) {
+        const TreeOfLife tree = clades.parse(clade);
+        log << "parsed " << tree.total_nodes << " nodes in " << seconds_since(begin) << " s" << endl;
+        begin = Clock::now();
+        JsonWriter json;
+        tree.write_json(json);
+        payload = json.to_string();
+    }
+    else payload = clades.newick(clade) + "\n";
+
+    out.write(payload.data(), payload.size());
+    out.flush();
+    if (!out) {
+        log << "could not write " << (options.output.size() > 0 ? options.output : "stdout") << endl;
+        return 1;
+    }
+    log << "wrote " << payload.size() / 1e6 << " MB in " << seconds_since(begin) << " s" << endl;
+}
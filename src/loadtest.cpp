@@ -0,0 +1,176 @@
+#include <json.hpp>
+#include <parallel.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * A load test client for bin/serve. Each connection is a thread that sends
+ * keep-alive GET requests one at a time and records the latencies.
+ */
+struct Options {
+    int port, connections, requests, max_id;
+    std::vector<std::string> paths;
+
+    Options() : port(8080), connections(8), requests(10000), max_id(0) {}
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--port") port = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--connections") connections = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--requests") requests = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--random-nodes") max_id = atoi(argv[++i]);
+            else if (arg.size() > 0 && arg[0] == '/') paths.push_back(arg);
+            else return false;
+        }
+        if (connections < 1 || requests < 1) return false;
+        if (paths.empty() && max_id == 0) paths.push_back("/node?id=1&depth=3");
+        return true;
+    }
+
+    static void usage(std::ostream &os) {
+        os << "usage: bin/loadtest [options] [PATH...]" << std::endl
+           << "  --port N            server port on 127.0.0.1 (default 8080)" << std::endl
+           << "  --connections N     concurrent keep-alive connections (default 8)" << std::endl
+           << "  --requests N        total number of requests (default 10000)" << std::endl
+           << "  --random-nodes MAX  request /node?id=R&depth=2 for random R in 1..MAX" << std::endl
+           << "PATHs (e.g. /search?q=Canis) are requested in round-robin order" << std::endl;
+    }
+};
+
+class Client {
+public:
+    typedef std::runtime_error error;
+
+    Client(int port) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) throw error("socket failed");
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            throw error("could not connect to port "+to_string(port));
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~Client() { close(fd); }
+
+    /** Sends a GET request and returns the HTTP status */
+    int get(const std::string &path) {
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != ssize_t(request.size()))
+            throw error("send failed");
+
+        size_t head_end;
+        while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) receive();
+
+        const int status = atoi(buffer.c_str() + buffer.find(' ') + 1);
+        size_t length_pos = buffer.find("Content-Length: ");
+        if (length_pos == std::string::npos || length_pos > head_end)
+            throw error("no content length");
+        const size_t length = atol(buffer.c_str() + length_pos + 16);
+
+        while (buffer.size() < head_end + 4 + length) receive();
+        buffer.erase(0, head_end + 4 + length);
+        return status;
+    }
+
+private:
+    int fd;
+    std::string buffer;
+
+    Client(const Client&);
+    Client& operator=(const Client&);
+
+    void receive() {
+        char buf[65536];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) throw error("connection closed");
+        buffer.append(buf, n);
+    }
+};
+
+int main(int argc, char *argv[]) {
+
+    using std::endl;
+    typedef std::chrono::steady_clock Clock;
+
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(std::cerr);
+        return 1;
+    }
+
+    std::vector< std::vector<double> > latencies(options.connections);
+    std::vector<int> errors(options.connections, 0);
+
+    Clock::time_point begin = Clock::now();
+
+    run_parallel(options.connections, [&](int c) {
+        Client client(options.port);
+        std::mt19937 rng(c);
+        const int n = options.requests / options.connections +
+            (c < options.requests % options.connections ? 1 : 0);
+
+        for (int i = 0; i < n; ++i) {
+            std::string path;
+            if (options.max_id > 0)
+                path = "/node?id=" + to_string(rng() % options.max_id + 1) + "&depth=2";
+            else
+                path = options.paths[(i*options.connections + c) % options.paths.size()];
+
+            Clock::time_point t0 = Clock::now();
+            if (client.get(path) != 200) errors[c]++;
+            latencies[c].push_back(
+                std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+        }
+    });
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::vector<double> all;
+    int n_errors = 0;
+    for (int c = 0; c < options.connections; ++c) {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        n_errors += errors[c];
+    }
+    std::sort(all.begin(), all.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < all.size(); ++i) sum += all[i];
+
+    JsonStreamWriter json(std::cout);
+    json.begin('{')
+        .key("requests").value(int(all.size()))
+        .key("errors").value(n_errors)
+        .key("connections").value(options.connections)
+        .key("seconds").value(seconds)
+        .key("requests_per_second").value(all.size() / seconds)
+        .key("mean_ms").value(sum / all.size())
+        .key("p50_ms").value(all[all.size()/2])
+        .key("p99_ms").value(all[std::min(all.size()-1, all.size()*99/100)])
+    .end('}');
+    std::cout << endl;
+
+    return n_errors > 0 ? 1 : 0;
+}
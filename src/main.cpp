@@ -1,186 +1,344 @@
 #include <tree.hpp>
 #include <trie.hpp>
+#include <output.hpp>
+#include <search.hpp>
+#include <snapshot.hpp>
+#include <ancestry.hpp>
+#include <pack.hpp>
+#include <async_output.hpp>
+#include <algorithm>
+#include <memory>
 #include <assert.h>
 
-std::ostream &format_bytes(std::ostream &os, size_t bytes) {
-    os  << (bytes / 1024) << " kB";
-    return os;
+/** The ids of the subtrees from the root subtree 0 to the given subtree */
+void write_subtree_path_json(JsonWriter &json, const AncestorIndex &subtree_ancestors,
+                             int subtree_id) {
+    const std::vector<int> path = subtree_ancestors.path_to_root(subtree_id);
+    json.key("path").begin('[');
+    for (size_t i = path.size(); i > 0; --i) json.value(path[i-1]);
+    json.end(']');
 }
 
-template <class Tree>
-void write_json_tree(const Tree& tree, std::string fn, std::ostream &log) {
-    log << "writing tree " << fn <<  "\t";
-    JsonWriter json(fn);
-    tree.write_json(json);
-    format_bytes(log, json.bytes_written()) << std::endl;
+/**
+ * The child subtrees most likely to be entered next, as [subtree id, bytes]
+ * pairs, where bytes is the size of the document the browser loads first
+ */
+void write_prefetch_json(JsonWriter &json, const TreeOfLife::PrefetchHints &hints,
+                         int subtree_id, const std::vector<size_t> &bytes) {
+    TreeOfLife::PrefetchHints::const_iterator found = hints.find(subtree_id);
+    if (found == hints.end()) return;
+    
+    json.key("prefetch").begin('[');
+    for (size_t i = 0; i < found->second.size(); ++i) {
+        const int child = found->second[i].subtree_id;
+        json.begin('[').value(child).value((long long)bytes[child]).end(']');
+    }
+    json.end(']');
+}
+
+void write_subtree_index_json(const std::map<int,int> &parent_map,
+                              const TreeOfLife::PrefetchHints &hints,
+                              const std::vector<size_t> &bytes, bool lod, OutputSink &out) {
+    const AncestorIndex subtree_ancestors(parent_map, 0);
+    JsonWriter json;
+    json.begin('{');
+    
+    json.key("0").begin('{');
+    write_subtree_path_json(json, subtree_ancestors, 0);
+    if (lod) json.key("lod").value(true);
+    write_prefetch_json(json, hints, 0, bytes);
+    json.end('}');
+    
+    for(std::map<int,int>::const_iterator itr = parent_map.begin();
+        itr != parent_map.end();
+        ++itr) {
+        json.key(to_string(itr->first))
+            .begin('{')
+                .key("parent").value(itr->second);
+        write_subtree_path_json(json, subtree_ancestors, itr->first);
+        if (lod) json.key("lod").value(true);
+        write_prefetch_json(json, hints, itr->first, bytes);
+        json.end('}');
+    }
+    json.end('}');
+    out.write("subtree-index", json.to_string());
 }
 
-class SearchTree {
-public:
-    SearchTree(std::string json_name_prefix, std::ostream &log_) :
-        log(log_),
-        json_prefix(json_name_prefix)
-    {}
+/** {"removed node id": id of the node that replaced it, ...} */
+void write_collapsed_ids_json(const std::map<int,int> &collapsed, OutputSink &out) {
+    JsonWriter json;
+    json.begin('{');
+    for (std::map<int,int>::const_iterator itr = collapsed.begin(); itr != collapsed.end(); ++itr)
+        json.key(to_string(itr->first)).value(itr->second);
+    json.end('}');
+    out.write("collapsed-ids", json.to_string());
+}
 
-    void traverse_tree(const TreeOfLife& tree, int subtree_id) {
-        TreeOfLife::const_iterator c = tree.children.begin(); 
-        visit(tree, subtree_id);
-        while (c != tree.children.end()) {
-            traverse_tree(*c, subtree_id);
-             ++c;
-        }
+/** The largest and the sum of the depths of the leaves below tree */
+void leaf_depths(const TreeOfLife &tree, int depth, int &max_depth, long long &sum) {
+    if (tree.children.empty()) {
+        max_depth = std::max(max_depth, depth);
+        sum += depth;
     }
+    for (TreeOfLife::const_iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+        leaf_depths(*c, depth + 1, max_depth, sum);
+}
+
+/** Collapses the unary chains of unnamed nodes and reports what it saved */
+std::map<int,int> collapse_unary_nodes(TreeOfLife &tree, std::ostream &log) {
+    using std::endl;
     
-    void compress() {
-        if (!compressed_trie.empty())
-            throw std::runtime_error("already compressed");
-        compressed_trie.copy_char_trie(char_trie);
-    }
+    log << "collapsing unary unnamed nodes..." << endl;
+    JsonSizeWriter before_json;
+    tree.write_json(before_json);
+    int before_depth = 0, after_depth = 0;
+    long long before_sum = 0, after_sum = 0;
+    leaf_depths(tree, 0, before_depth, before_sum);
+    const int before_nodes = tree.total_nodes;
     
-    void decompose_and_write_jsons() const {
-        if (compressed_trie.empty()) throw std::runtime_error("not compressed");
-        
-        JsonWriter root_json(json_prefix + "0.json");
-        int subtree_id = 0;
-        decomposed_write_json(compressed_trie, root_json, subtree_id);
-    }
+    std::map<int,int> collapsed;
+    const int n_removed = tree.collapse_unary(collapsed);
+    assert(before_nodes - n_removed == tree.total_nodes);
     
-    struct Pointer {
-        int id;
-        int subtree;
-        
-        void write_json(JsonWriter &json) const {
-            json.begin('[')
-                .value(id)
-                .value(subtree)
-                .end(']');
-        }
-    };
-    
-private:
-    UnicodeTrie<Pointer> char_trie;
-    StringTrie<Pointer> compressed_trie;
-    
-    std::ostream &log;
-    std::string json_prefix;
-    
-    void visit(const TreeOfLife &tree, int subtree_id) {
-        if (tree.name.size() > 0) {
-            std::string name = tree.name;
-            normalize_case(name);
-            
-            Pointer value = { tree.id, subtree_id };
-            const Pointer* existing = char_trie.lookup(name);
-            
-            //std::cerr << "storing " << name << std::endl;
-            
-            if (existing) {
-                if (existing->id == tree.id) return;
-                name += " (" + tree.ext_id + ")";
-                existing = char_trie.lookup(name);
-                if (existing && existing->id == tree.id) return;
-            }
-            char_trie.insert(name, value);
-        }
-    }
+    JsonSizeWriter after_json;
+    tree.write_json(after_json);
+    leaf_depths(tree, 0, after_depth, after_sum);
     
-    void decomposed_write_json(
-            const StringTrie<Pointer> &tree,
-            JsonWriter &root_json,
-            int &subtree_index) const {
-        
-        const int MAX_SUBTREE_SIZE = 120000;
-        const int MIN_SUBTREE_SIZE = 2000;
-        
-        root_json.begin('{');
-        
-        if (tree.total_nodes <= MAX_SUBTREE_SIZE && tree.total_nodes >= MIN_SUBTREE_SIZE) {
-            int idx = ++subtree_index;
-            root_json.key("subtree_index").value(idx);
-            std::string name = json_prefix + to_string(idx) + ".json";
-            write_json_tree(tree, name, log);
-        }
-        else {
-        
-            if (tree.children.size() > 0) {
-                root_json.key("c");
-                root_json.begin('{');
-                
-                for(StringTrie<Pointer>::const_iterator c = tree.children.begin(); 
-                    c != tree.children.end();
-                    ++c)
-                {
-                    root_json.key(c->first);
-                    decomposed_write_json(c->second, root_json, subtree_index);
-                }
-                root_json.end('}');
-            }
-            
-            if (tree.has_value) {
-                root_json.key("v").value(tree.value);
+    log << "removed " << n_removed << " of " << before_nodes << " nodes" << endl;
+    log << "leaf depth max " << before_depth << " -> " << after_depth << ", mean "
+        << double(before_sum) / tree.total_leaves << " -> "
+        << double(after_sum) / tree.total_leaves << " levels" << endl;
+    log << "tree JSON ";
+    format_bytes(log, before_json.size()) << " -> ";
+    format_bytes(log, after_json.size()) << endl;
+    return collapsed;
+}
+
+struct Options {
+    std::string snapshot_out, snapshot_in;
+    bool pack, lod, collapse_unary;
+    TreeOfLife::LodParams lod_params;
+    std::string writer;
+    AsyncDirectorySink::FsyncPolicy fsync;
+    int top_k;
+    int schema;
+    SearchTree::SubtreeParams search_subtrees;
+    TreeOfLife::DecompositionParams decomposition;
+    
+    Options() : pack(false), lod(false), collapse_unary(false), writer("uring"),
+                fsync(AsyncDirectorySink::FSYNC_NONE), top_k(5), schema(1) {}
+    
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--snapshot") snapshot_out = argv[++i];
+            else if (i + 1 < argc && arg == "--from-snapshot") snapshot_in = argv[++i];
+            else if (arg == "--pack") pack = true;
+            else if (arg == "--lod") lod = true;
+            else if (arg == "--collapse-unary") collapse_unary = true;
+            else if (i + 1 < argc && arg == "--lod-depth") lod_params.max_depth = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--lod-weight") lod_params.min_weight = atof(argv[++i]);
+            else if (i + 1 < argc && arg == "--writer") writer = argv[++i];
+            else if (i + 1 < argc && arg == "--fsync") {
+                try { fsync = AsyncDirectorySink::parse_fsync_policy(argv[++i]); }
+                catch (std::exception &) { return false; }
             }
+            else if (i + 1 < argc && arg == "--top-k") top_k = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--schema") schema = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--search-filter-bytes")
+                search_subtrees.filter_bytes = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--decompose-threads")
+                decomposition.n_threads = atoi(argv[++i]);
+            else return false;
         }
-        
-        root_json.end('}');
+        if (top_k < 0 || search_subtrees.filter_bytes < 0) return false;
+        if (decomposition.n_threads < 1) return false;
+        if (schema != 1 && schema != 2) return false;
+        // only the background writers flush to disk
+        if (fsync != AsyncDirectorySink::FSYNC_NONE && (pack || writer == "sync")) return false;
+        return writer == "uring" || writer == "thread" || writer == "sync";
     }
     
-    /** Capitalizes the first letter of the string (if an ASCII char) */
-    void normalize_case(std::string &str) {
-        assert(str.size() > 0);
-        if (str[0] >= 'a' && str[0] <= 'z') str[0] = str[0] + ('A'-'a');
+    static void usage(std::ostream &os) {
+        os << "usage: bin/main [options] < source.tre" << std::endl
+           << "  --snapshot FILE       also save the parsed tree as a binary snapshot" << std::endl
+           << "  --from-snapshot FILE  read the tree from a snapshot instead of stdin" << std::endl
+           << "  --pack                write data/tree.pack and data/tree-index.json" << std::endl
+           << "                        instead of separate files" << std::endl
+           << "  --lod                 also write subtree-N-lod.json files in which small" << std::endl
+           << "                        sibling groups are collapsed into aggregate nodes" << std::endl
+           << "  --lod-depth N         collapse all children deeper than N levels below" << std::endl
+           << "                        the subtree root (default 6)" << std::endl
+           << "  --lod-weight F        collapse children with fewer than F times the leaves" << std::endl
+           << "                        of the subtree root (default 0.005)" << std::endl
+           << "  --collapse-unary      replace unnamed nodes with one child by the child" << std::endl
+           << "                        and write their ids to data/collapsed-ids.json" << std::endl
+           << "  --schema N            subtree documents with a parents map (1, the" << std::endl
+           << "                        default) or with the parents implied by the" << std::endl
+           << "                        nesting only (2)" << std::endl
+           << "  --writer MODE         how separate files are written: uring (default,"  << std::endl
+           << "                        batched io_uring writes in a background thread),"  << std::endl
+           << "                        thread (blocking writes in a background thread)"  << std::endl
+           << "                        or sync (in the calling thread)" << std::endl
+           << "  --fsync POLICY        none (default), each file, or end of the run;" << std::endl
+           << "                        for the uring and thread writers, not with --pack" << std::endl
+           << "  --top-k K             list the K names with the most leaves at each" << std::endl
+           << "                        node of the search index (default 5, 0 = none)" << std::endl
+           << "  --search-filter-bytes N" << std::endl
+           << "                        bytes of the Bloom filter of the prefixes in each" << std::endl
+           << "                        search subtree, in search-0.json (default 2048," << std::endl
+           << "                        0 = none)" << std::endl
+           << "  --decompose-threads N search and copy the clades to split off on N" << std::endl
+           << "                        threads (default 1), unless read from a snapshot," << std::endl
+           << "                        whose decomposition copies nothing" << std::endl;
     }
 };
 
-void write_subtree_index_json(const std::map<int,int> &parent_map) {
-    JsonWriter json("data/subtree-index.json");
-    json.begin('{');
-    
-    json.key("0").begin('{').end('}');
-    
-    for(std::map<int,int>::const_iterator itr = parent_map.begin();
-        itr != parent_map.end();
-        ++itr)
-        json.key(to_string(itr->first))
-            .begin('{')
-                .key("parent").value(itr->second)
-            .end('}');
-    json.end('}');
-}
-
-int main() {
-    
+TreeOfLife read_tree(const Options &options, std::ostream &log) {
     using std::endl;
     
-    std::ostream &log = std::cerr;
+    if (options.snapshot_in.size() > 0) {
+        log << "reading snapshot " << options.snapshot_in << "..." << endl;
+        TreeSnapshot snapshot(options.snapshot_in);
+        return snapshot.to_tree();
+    }
     
     log << "reading Newick tree from stdin..." << endl;
     TreeOfLife tree(std::cin);
     
-    log << tree.name << endl;
-    log << tree.total_leaves << " leaf nodes" << endl;
-    log << tree.total_nodes << " nodes" << endl;
+    if (options.snapshot_out.size() > 0) {
+        log << "writing snapshot " << options.snapshot_out << "..." << endl;
+        TreeSnapshot::write(tree, options.snapshot_out);
+    }
+    return tree;
+}
+
+std::unique_ptr<OutputSink> open_output(const Options &options, std::ostream &log) {
+    const std::string prefix = "data/";
+    std::unique_ptr<OutputSink> out;
     
-    std::list<TreeOfLife> subtrees;
-    log << "decomposing..." << endl;
-    std::map<int,int> subtree_parents = tree.iterative_decomposition(subtrees);
-    log << "got " << subtrees.size() << " subtrees" << endl;
-    assert(subtrees.size() == subtree_parents.size()+1);
+    if (options.pack) out.reset(new PackSink(prefix + "tree"));
+    else if (options.writer == "sync") out.reset(new DirectorySink(prefix));
+    else {
+        AsyncDirectorySink *async = new AsyncDirectorySink(prefix,
+            options.writer == "uring" ? AsyncDirectorySink::IO_URING : AsyncDirectorySink::THREAD,
+            options.fsync);
+        out.reset(async);
+        
+        if (options.writer == "uring" && async->active_backend() != AsyncDirectorySink::IO_URING)
+            log << "io_uring not available, writing in a background thread" << std::endl;
+    }
+    return out;
+}
+
+template <class Tree>
+size_t write_lod_json_tree(const Tree &tree, const TreeOfLife::LodParams &params,
+                         int subtree_id, int schema, OutputSink &out, std::ostream &log) {
+    const std::string name = "subtree-"+to_string(subtree_id)+"-lod";
+    log << "writing tree " << name <<  "\t";
+    JsonWriter json;
+    tree.write_lod_json(json, params, subtree_id, schema);
+    const std::string payload = json.to_string();
+    out.write(name, payload);
+    format_bytes(log, payload.size()) << std::endl;
+    return payload.size();
+}
+
+/**
+ * Writes the subtree documents, the subtree index and the search index.
+ * The subtrees, in the order of their ids, are TreeOfLife copies or the
+ * TreeSnapshot::Subtree views of a mapped snapshot.
+ */
+template <class Subtrees>
+void write_subtrees(const Subtrees &subtrees, const std::map<int,int> &subtree_parents,
+                    const TreeOfLife::PrefetchHints &prefetch_hints,
+                    const std::map<int,int> &collapsed, const Options &options,
+                    std::ostream &log) {
+    using std::endl;
+    
+    std::unique_ptr<OutputSink> out = open_output(options, log);
     
-    write_subtree_index_json(subtree_parents);
+    if (options.collapse_unary) write_collapsed_ids_json(collapsed, *out);
     
     log << "generating search tree and writing subtree jsons..." << endl;
-    SearchTree search("data/search-", log);
+    SearchTree search("search-", *out, log, default_thread_count(), options.top_k,
+                      options.search_subtrees);
     
-    std::list<TreeOfLife>::const_iterator itr = subtrees.begin();
+    // the bytes of the document of each subtree that the browser loads first
+    std::vector<size_t> subtree_bytes(subtrees.size());
+    typename Subtrees::const_iterator itr = subtrees.begin();
     for (size_t subtree_id = 0; subtree_id < subtrees.size(); ++subtree_id) {
         search.traverse_tree(*itr, subtree_id);
-        std::string name = "data/subtree-"+to_string(subtree_id)+".json";
-        write_json_tree(*itr, name, log);
+        std::string name = "subtree-"+to_string(subtree_id);
+        subtree_bytes[subtree_id] = write_json_tree(*itr, name, *out, log, options.schema);
+        if (options.lod)
+            subtree_bytes[subtree_id] = write_lod_json_tree(*itr, options.lod_params, subtree_id,
+                                                            options.schema, *out, log);
         itr++;
     }
     
+    // after the subtrees, to list their sizes in the prefetch hints
+    write_subtree_index_json(subtree_parents, prefetch_hints, subtree_bytes, options.lod, *out);
+    
+    log << "skipped " << search.redundant_visits()
+        << " redundant visits of overlapping subtree nodes" << endl;
+    
     log << "compressing search tree..." << endl;
     search.compress();
     
     search.decompose_and_write_jsons();
+    out->finish();
+}
+
+int main(int argc, char *argv[]) {
+    
+    using std::endl;
+    
+    std::ostream &log = std::cerr;
+    
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(log);
+        return 1;
+    }
+    
+    std::map<int,int> subtree_parents, collapsed;
+    TreeOfLife::PrefetchHints prefetch_hints;
+    
+    if (options.snapshot_in.size() > 0 && !options.collapse_unary) {
+        // decomposed and written from the mapped nodes, without a copy
+        log << "reading snapshot " << options.snapshot_in << "..." << endl;
+        TreeSnapshot snapshot(options.snapshot_in);
+        
+        log << snapshot.name(0) << endl;
+        log << snapshot.node(0).total_leaves << " leaf nodes" << endl;
+        log << snapshot.size() << " nodes" << endl;
+        
+        std::vector<TreeSnapshot::Subtree> subtrees;
+        log << "decomposing..." << endl;
+        subtree_parents = snapshot.iterative_decomposition(subtrees, options.decomposition,
+                                                           &prefetch_hints);
+        log << "got " << subtrees.size() << " subtrees" << endl;
+        assert(subtrees.size() == subtree_parents.size()+1);
+        
+        write_subtrees(subtrees, subtree_parents, prefetch_hints, collapsed, options, log);
+        return 0;
+    }
+    
+    TreeOfLife tree = read_tree(options, log);
+    
+    log << tree.name << endl;
+    log << tree.total_leaves << " leaf nodes" << endl;
+    log << tree.total_nodes << " nodes" << endl;
+    
+    if (options.collapse_unary) collapsed = collapse_unary_nodes(tree, log);
+    
+    std::list<TreeOfLife> subtrees;
+    log << "decomposing..." << endl;
+    subtree_parents = tree.iterative_decomposition(subtrees, options.decomposition,
+                                                   &prefetch_hints);
+    log << "got " << subtrees.size() << " subtrees" << endl;
+    assert(subtrees.size() == subtree_parents.size()+1);
+    
+    write_subtrees(subtrees, subtree_parents, prefetch_hints, collapsed, options, log);
 }
@@ -0,0 +1,186 @@
+#include <tree.hpp>
+#include <json.hpp>
+#include <snapshot.hpp>
+#include <http.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/**
+ * Answers on-demand queries against a tree snapshot:
+ *
+ *   /node?id=X&depth=D&max_nodes=N
+ *      the subtree of node X in the schema of the "data" member of the
+ *      subtree-N.json files, cut at depth D or N nodes
+ *
+ *   /search?q=PREFIX&limit=K
+ *      the first K nodes (i, n, s) whose names start with the prefix in
+ *      alphabetical order, with the same case normalization as the search
+ *      index files
+ */
+class TreeService {
+public:
+    TreeService(const TreeSnapshot &snapshot_) : snapshot(snapshot_) {
+        for (size_t i = 0; i < snapshot.size(); ++i) {
+            const int id = snapshot.node(i).id;
+            if (id >= int(id_index.size())) id_index.resize(id + 1, size_t(NOT_FOUND));
+            id_index[id] = i;
+
+            if (*snapshot.name(i) != '\0') names.push_back(i);
+        }
+        std::sort(names.begin(), names.end(), NameOrder(snapshot));
+    }
+
+    HttpServer::Response handle(const HttpServer::Request &request) const {
+        if (request.path == "/node") return node(request);
+        if (request.path == "/search") return search(request);
+        return HttpServer::Response(404, "not found\n", "text/plain");
+    }
+
+private:
+    static const size_t NOT_FOUND = size_t(-1);
+
+    static const int DEFAULT_DEPTH = 2;
+    static const int DEFAULT_MAX_NODES = 2000;
+    static const int MAX_NODES_LIMIT = 200000;
+    static const int DEFAULT_SEARCH_LIMIT = 10;
+    static const int SEARCH_LIMIT = 1000;
+
+    const TreeSnapshot &snapshot;
+    std::vector<size_t> id_index;
+    // indices of named nodes sorted by normalized name
+    std::vector<size_t> names;
+
+    /** Compares names as if their first letter was capitalized */
+    struct NameOrder {
+        const TreeSnapshot &snapshot;
+        NameOrder(const TreeSnapshot &s) : snapshot(s) {}
+
+        static int compare(const char *a, const char *b) {
+            if (*a != '\0' && *b != '\0') {
+                char ca = capitalize(*a), cb = capitalize(*b);
+                if (ca != cb) return (unsigned char)ca < (unsigned char)cb ? -1 : 1;
+                return strcmp(a + 1, b + 1);
+            }
+            return strcmp(a, b);
+        }
+
+        bool operator()(size_t a, size_t b) const {
+            return compare(snapshot.name(a), snapshot.name(b)) < 0;
+        }
+        bool operator()(size_t a, const std::string &prefix) const {
+            return compare(snapshot.name(a), prefix.c_str()) < 0;
+        }
+    };
+
+    static char capitalize(char c) {
+        if (c >= 'a' && c <= 'z') return c + ('A'-'a');
+        return c;
+    }
+
+    static bool starts_with(const char *name, const std::string &prefix) {
+        if (prefix.empty()) return true;
+        if (capitalize(*name) != capitalize(prefix[0])) return false;
+        return strncmp(name + 1, prefix.c_str() + 1, prefix.size() - 1) == 0;
+    }
+
+    HttpServer::Response node(const HttpServer::Request &request) const {
+        const int id = request.int_param("id", snapshot.node(0).id);
+        const int depth = request.int_param("depth", DEFAULT_DEPTH);
+        const int max_nodes = std::min(
+            request.int_param("max_nodes", DEFAULT_MAX_NODES), MAX_NODES_LIMIT);
+
+        if (id < 0 || id >= int(id_index.size()) || id_index[id] == NOT_FOUND)
+            return HttpServer::Response(404, "no such node\n", "text/plain");
+
+        JsonWriter json;
+        snapshot.write_json(json, id_index[id], depth, max_nodes);
+        return HttpServer::Response(200, json.to_string());
+    }
+
+    HttpServer::Response search(const HttpServer::Request &request) const {
+        const std::string prefix = request.param("q");
+        const int limit = std::min(
+            request.int_param("limit", DEFAULT_SEARCH_LIMIT), SEARCH_LIMIT);
+
+        std::vector<size_t>::const_iterator itr = std::lower_bound(
+            names.begin(), names.end(), prefix, NameOrder(snapshot));
+
+        JsonWriter json;
+        json.begin('{');
+        json.key("q").value(prefix);
+        json.key("r");
+        json.begin('[');
+        for (int n = 0; n < limit && itr != names.end() &&
+                starts_with(snapshot.name(*itr), prefix); ++n, ++itr) {
+            const TreeSnapshot::Node &node = snapshot.node(*itr);
+            json.begin('{');
+            json.key("i").value(node.id);
+            json.key("n").value(snapshot.name(*itr));
+            if (node.total_leaves > 1) json.key("s").value(node.total_leaves);
+            json.end('}');
+        }
+        json.end(']');
+        json.end('}');
+        return HttpServer::Response(200, json.to_string());
+    }
+};
+
+struct Options {
+    int port;
+    std::string snapshot_in;
+
+    Options() : port(8080) {}
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--port") port = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--from-snapshot") snapshot_in = argv[++i];
+            else return false;
+        }
+        return true;
+    }
+
+    static void usage(std::ostream &os) {
+        os << "usage: bin/serve [options] < source.tre" << std::endl
+           << "  --port N              listen on 127.0.0.1:N (default 8080)" << std::endl
+           << "  --from-snapshot FILE  read the tree from a snapshot instead of stdin" << std::endl;
+    }
+};
+
+int main(int argc, char *argv[]) {
+
+    using std::endl;
+
+    std::ostream &log = std::cerr;
+
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(log);
+        return 1;
+    }
+
+    std::unique_ptr<TreeSnapshot> snapshot;
+    if (options.snapshot_in.size() > 0) {
+        log << "reading snapshot " << options.snapshot_in << "..." << endl;
+        snapshot.reset(new TreeSnapshot(options.snapshot_in));
+    }
+    else {
+        log << "reading Newick tree from stdin..." << endl;
+        TreeOfLife tree(std::cin);
+        snapshot.reset(new TreeSnapshot(tree));
+    }
+
+    log << snapshot->size() << " nodes" << endl;
+
+    TreeService service(*snapshot);
+    HttpServer server(options.port, [&service](const HttpServer::Request &request) {
+        return service.handle(request);
+    });
+
+    log << "listening on http://127.0.0.1:" << options.port << "/" << endl;
+    server.run();
+}
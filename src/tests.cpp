@@ -3,11 +3,32 @@
 #include <tree.hpp>
 #include <json.hpp>
 #include <utf8.hpp>
+#include <search.hpp>
+#include <snapshot.hpp>
+#include <http.hpp>
+#include <ancestry.hpp>
+#include <output.hpp>
+#include <pack.hpp>
+#include <async_output.hpp>
+#include <synthetic.hpp>
+#include <newick.hpp>
+#include <treestats.hpp>
+#include <extract.hpp>
+#include <bloom.hpp>
 
 #include <assert.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <set>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 template <class Trie>
-void trie_structure_json(const Trie &trie, JsonWriter &json) {
+void trie_structure_json(const Trie &trie, CheckedJsonWriter &json) {
     json.begin('{');
     for(typename Trie::const_iterator c = trie.children.begin(); 
         c != trie.children.end();
@@ -21,7 +42,7 @@ void trie_structure_json(const Trie &trie, JsonWriter &json) {
 
 template <class Trie>
 std::string trie_structure_json(const Trie &trie) {
-    JsonWriter json;
+    CheckedJsonWriter json;
     trie_structure_json(trie,json);
     return json.to_string();
 }
@@ -30,11 +51,21 @@ std::string trie_structure_json(const Trie &trie) {
 
 using std::string;
 
-void run_json_tests() {
-    {
-    JsonWriter json;
-    assert(json.to_string() == string(""));
-    
+// the files of the tests go to a fresh directory under $TMPDIR or /tmp,
+// so that they run from any working directory
+static string temp_dir;
+
+string temp_path(const string &name) {
+    if (temp_dir.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        string pattern = string(tmp != NULL && *tmp != 0 ? tmp : "/tmp") + "/tree-tests-XXXXXX";
+        if (mkdtemp(&pattern[0]) == NULL) throw std::runtime_error("could not create "+pattern);
+        temp_dir = pattern;
+    }
+    return temp_dir + "/" + name;
+}
+
+template <class Writer> void write_json_test_document(Writer &json) {
     json.begin('{')
         .key("foo")
         .value(2)
@@ -47,40 +78,60 @@ void run_json_tests() {
             .value(true)
             .value(2.5)
             .value(3)
+            .value(-17)
+            .value(-1234567890123LL)
         .end(']')
     .end('}');
-    
-    assert(json.to_string() == string(
+}
+
+void run_json_tests() {
+    {
+    const string expected =
         "{\"foo\":2,\"bar\":["
         "\"AC\\/DC\\n\\t\\r\\u0008 \\\\ \","
-        "null,{},true,2.5,3]}"));
+        "null,{},true,2.5,3,-17,-1234567890123]}";
+    
+    CheckedJsonWriter json;
+    assert(json.to_string() == string(""));
+    write_json_test_document(json);
+    assert(json.to_string() == expected);
+    
+    // the unchecked and stream writers produce the same output
+    JsonWriter unchecked;
+    write_json_test_document(unchecked);
+    assert(unchecked.to_string() == expected);
+    
+    std::ostringstream oss;
+    JsonStreamWriter stream_json(oss);
+    write_json_test_document(stream_json);
+    assert(oss.str() == expected);
     }
     
     {
-    JsonWriter json;
+    CheckedJsonWriter json;
     
-    ASSERT_THROWS(JsonWriter::error, json.end('}') );
-    ASSERT_THROWS(JsonWriter::error, json.key("foo") );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.end('}') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.key("foo") );
     
     json.begin('{');
-    ASSERT_THROWS(JsonWriter::error, json.value(1) );
-    ASSERT_THROWS(JsonWriter::error, json.begin('{') );
-    ASSERT_THROWS(JsonWriter::error, json.end(']') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.value(1) );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.begin('{') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.end(']') );
     json.key("foo");
-    ASSERT_THROWS(JsonWriter::error, json.key("bar") );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.key("bar") );
     json.begin('[');
-    ASSERT_THROWS(JsonWriter::error, json.key("baz") );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.key("baz") );
     json.value(1);
     json.end(']');
     json.end('}');
-    ASSERT_THROWS(JsonWriter::error, json.value(1) );
-    ASSERT_THROWS(JsonWriter::error, json.key("fsd") );
-    ASSERT_THROWS(JsonWriter::error, json.end('}') );
-    ASSERT_THROWS(JsonWriter::error, json.begin('[') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.value(1) );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.key("fsd") );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.end('}') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.begin('[') );
     }
     
     {
-    JsonWriter json;
+    CheckedJsonWriter json;
     json.begin('[');
     json.value(1);
     json.end(']');
@@ -88,11 +139,11 @@ void run_json_tests() {
     }
     
     {
-    JsonWriter json;
+    CheckedJsonWriter json;
     json.value(1);
-    ASSERT_THROWS(JsonWriter::error, json.value(2) );
-    ASSERT_THROWS(JsonWriter::error, json.begin('{') );
-    ASSERT_THROWS(JsonWriter::error, json.end('}') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.value(2) );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.begin('{') );
+    ASSERT_THROWS(CheckedJsonWriter::error, json.end('}') );
     assert(json.to_string() == string("1"));
     }
     
@@ -144,11 +195,11 @@ void run_trie_tests() {
     utf8_string_trie.copy_char_trie(utf8_trie);
     assert(trie_structure_json(utf8_string_trie) == "{\"\xC3\xA0\":{},\"\xC3\xA1\":{}}");
     
-    JsonWriter utf8_json;
+    CheckedJsonWriter utf8_json;
     utf8_string_trie.write_json(utf8_json);
     assert(utf8_json.to_string() == string("{\"c\":{\"\xC3\xA0\":{\"v\":1},\"\xC3\xA1\":{\"v\":2}}}"));
     
-    JsonWriter other_json;
+    CheckedJsonWriter other_json;
     other_json.begin("{");
     other_json.key("root");
     other_json.value(utf8_string_trie);
@@ -160,6 +211,54 @@ void run_trie_tests() {
     std::cerr << "trie tests passed" << std::endl;
 }
 
+void run_newick_tests() {
+
+    const string text = "(a_ott1,'b,(c'' ott2')x_ott3;";
+    const uint32_t expected[] = { 0, 7, 8, 13, 14, 20, 21, 28 };
+    NewickIndex index(text.data(), text.size(), NewickIndex::SCALAR);
+    assert(index.size() == sizeof(expected) / sizeof(expected[0]));
+    for (size_t i = 0; i < index.size(); ++i) assert(index[i] == expected[i]);
+
+    // the vectorized kernels agree with the scalar one across block boundaries
+    const char alphabet[] = "(),;'_ab";
+    srand(7);
+    for (int length = 0; length < 300; length += 7) {
+        string random_text;
+        for (int i = 0; i < length; ++i) random_text += alphabet[rand() % 8];
+        NewickIndex scalar(random_text.data(), random_text.size(), NewickIndex::SCALAR);
+        for (int k = NewickIndex::SSE2; k <= NewickIndex::AVX2; ++k) {
+            const NewickIndex::Kernel kernel = NewickIndex::Kernel(k);
+            if (!NewickIndex::supported(kernel)) continue;
+            NewickIndex vectorized(random_text.data(), random_text.size(), kernel);
+            assert(vectorized.size() == scalar.size());
+            for (size_t i = 0; i < scalar.size(); ++i) assert(vectorized[i] == scalar[i]);
+        }
+    }
+
+    NewickReader reader(text.data(), text.size());
+    assert(reader.get() == '(');
+    assert(reader.read_name() == "a ott1");
+    assert(reader.get() == ',');
+    assert(reader.read_name() == "b,(c' ott2");
+    assert(reader.get() == ')');
+    assert(reader.read_name() == "x ott3");
+    assert(reader.get() == ';');
+    assert(reader.peek() == EOF);
+
+    const string newick = random_newick(2000, 5);
+    std::istringstream newick_input(newick);
+    CheckedJsonWriter from_stream, from_memory;
+    TreeOfLife(newick_input).write_json(from_stream);
+    TreeOfLife(newick.data(), newick.size()).write_json(from_memory);
+    assert(from_stream.to_string() == from_memory.to_string());
+
+    ASSERT_THROWS(NewickReader::error, TreeOfLife("(a_ott1,b'_ott2);", 17));
+    ASSERT_THROWS(NewickReader::error, TreeOfLife("(a_ott1,'b'c_ott2);", 19));
+    ASSERT_THROWS(TreeOfLife::error, TreeOfLife("(a_ott1,b_ott2;", 15));
+
+    std::cerr << "newick tests passed" << std::endl;
+}
+
 void run_tree_of_life_tests() {
     
     std::istringstream newick_input(
@@ -167,7 +266,7 @@ void run_tree_of_life_tests() {
     );
     
     TreeOfLife tol(newick_input);
-    JsonWriter json;
+    CheckedJsonWriter json;
     tol.write_json(json);
     
     string expected(
@@ -181,19 +280,20 @@ void run_tree_of_life_tests() {
                         "\"n\":\"land\","
                         "\"s\":2,"
                         "\"c\":["
-                            "{\"i\":3,\"n\":\"Raccoon\"},"
-                            "{\"i\":4,\"n\":\"bear\"}"
+                            "{\"i\":3,\"n\":\"Raccoon\",\"s\":1},"
+                            "{\"i\":4,\"n\":\"bear\",\"s\":1,\"o\":1}"
                         "]"
                     "},"
                     "{"
                         "\"i\":5,"
                         "\"s\":2,"
+                        "\"o\":2,"
                         "\"c\":["
-                            "{\"i\":6,\"n\":\"'sEA' lion\"},"
-                            "{\"i\":7,\"n\":\"seal\"}"
+                            "{\"i\":6,\"n\":\"'sEA' lion\",\"s\":1},"
+                            "{\"i\":7,\"n\":\"seal\",\"s\":1,\"o\":1}"
                         "]"
                     "},"
-                    "{\"i\":8,\"n\":\"(dog),;\"}"
+                    "{\"i\":8,\"n\":\"(dog),;\",\"s\":1,\"o\":4}"
                 "]"
             "},"
             "\"parents\":{"
@@ -210,9 +310,1086 @@ void run_tree_of_life_tests() {
     
     assert(json.to_string() == expected);
     
+    // schema 2 leaves the parents to the nesting
+    CheckedJsonWriter v2_json, content_json;
+    tol.write_json(v2_json, 2);
+    tol.write_content_json(content_json);
+    assert(v2_json.to_string() == "{\"v\":2,\"data\":" + content_json.to_string() + "}");
+    assert(expected.find(content_json.to_string()) == 8);
+    
+    {
+    // unary chains of unnamed nodes below the root collapse into their end,
+    // the unary root stays
+    std::istringstream unary_input(
+        "((((a_ott1)mrcaott1ott2)b_ott3,(((c_ott4,d_ott5)))))mrcaott6ott7;"
+    );
+    TreeOfLife unary(unary_input);
+    assert(unary.total_nodes == 10);
+    
+    std::map<int, int> collapsed;
+    assert(unary.collapse_unary(collapsed) == 3);
+    assert(unary.total_nodes == 7);
+    assert(unary.total_leaves == 3);
+    
+    CheckedJsonWriter unary_json;
+    unary.write_content_json(unary_json);
+    assert(unary_json.to_string() ==
+        "{\"i\":1,\"s\":3,\"c\":[{\"i\":2,\"s\":3,\"c\":["
+            "{\"i\":8,\"s\":2,\"c\":[{\"i\":9,\"n\":\"c\",\"s\":1},{\"i\":10,\"n\":\"d\",\"s\":1,\"o\":1}]},"
+            "{\"i\":3,\"n\":\"b\",\"s\":1,\"o\":2,\"c\":[{\"i\":5,\"n\":\"a\",\"s\":1}]}"
+        "]}]}");
+    
+    std::map<int, int> expected_collapsed;
+    expected_collapsed[4] = 5;
+    expected_collapsed[6] = 8;
+    expected_collapsed[7] = 8;
+    assert(collapsed == expected_collapsed);
+    
+    // the tree is stable
+    collapsed.clear();
+    assert(unary.collapse_unary(collapsed) == 0);
+    assert(unary.total_nodes == 7);
+    }
+    
+    {
+    // a name that replaces an unnamed node moves it before its named ties
+    const string newick("(b_ott1,((a_ott2)));");
+    TreeOfLife unary(newick.data(), newick.size());
+    CheckedJsonWriter before;
+    unary.write_content_json(before);
+    assert(before.to_string() ==
+        "{\"i\":1,\"s\":2,\"c\":[{\"i\":2,\"n\":\"b\",\"s\":1},"
+        "{\"i\":3,\"s\":1,\"o\":1,\"c\":[{\"i\":4,\"s\":1,\"c\":[{\"i\":5,\"n\":\"a\",\"s\":1}]}]}]}");
+    
+    std::map<int, int> collapsed;
+    assert(unary.collapse_unary(collapsed) == 2);
+    CheckedJsonWriter after;
+    unary.write_content_json(after);
+    assert(after.to_string() ==
+        "{\"i\":1,\"s\":2,\"c\":[{\"i\":5,\"n\":\"a\",\"s\":1},{\"i\":2,\"n\":\"b\",\"s\":1,\"o\":1}]}");
+    }
+    
     std::cerr << "tol tests passed" << std::endl;
 }
 
+void run_extract_tests() {
+
+    const string newick =
+        "((Raccoon_ott2,'_bear_ott3')land_ott1,('''sEA''_lion_ott5',seal_ott6)x(y_ott4,"
+        "'(dog),;_ott7',(a_ott9)land_ott8)root_ott10;";
+    NewickClades clades(newick.data(), newick.size());
+
+    std::vector<NewickClades::Clade> found = clades.find("ott4");
+    assert(found.size() == 1);
+    assert(found[0].name == "x(y");
+    assert(found[0].id == 5);
+    assert(clades.newick(found[0]) == "('''sEA''_lion_ott5',seal_ott6)x(y_ott4;");
+
+    found = clades.find("'sEA' lion");
+    assert(found.size() == 1 && found[0].ext_id == "ott5" && found[0].id == 6);
+    assert(clades.find("(dog),;").size() == 1);
+    assert(clades.find("7")[0].id == 8);
+    assert(clades.find("root")[0].id == 1);
+    assert(clades.find("ott11").empty());
+    assert(clades.find("lion").empty());
+
+    found = clades.find("land");
+    assert(found.size() == 2);
+    assert(found[0].ext_id == "ott1" && found[1].ext_id == "ott8");
+
+    // the clade parses to the same document as in the whole tree
+    std::istringstream newick_input(newick);
+    TreeOfLife tol(newick_input);
+    const TreeOfLife &second_land = tol.children.back();
+    CheckedJsonWriter expected, extracted;
+    second_land.write_json(expected);
+    clades.parse(found[1]).write_json(extracted);
+    assert(extracted.to_string() == expected.to_string());
+
+    std::cerr << "extract tests passed" << std::endl;
+}
+
+int count_nodes(const TreeOfLife &tree) {
+    int n = 1;
+    for (TreeOfLife::const_iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+        n += count_nodes(*c);
+    return n;
+}
+
+void run_treestats_tests() {
+
+    std::istringstream newick_input("((a_ott2,b_ott3)c_ott1,(a_ott5)d_ott4,'\xc3\xa4_ott6');");
+    TreeOfLife tol(newick_input);
+    CheckedJsonWriter json;
+    json.value(TreeStats(tol));
+    
+    string expected(
+        "{"
+            "\"nodes\":7,"
+            "\"leaves\":4,"
+            "\"unary_nodes\":1,"
+            "\"depth\":{"
+                "\"leaves\":{\"count\":4,\"min\":1,\"max\":2,\"mean\":1.75,\"buckets\":[[1,1,1],[2,3,3]]},"
+                "\"nodes_by_depth\":[1,3,3]"
+            "},"
+            "\"fan_out\":{\"count\":3,\"min\":1,\"max\":3,\"mean\":2,\"buckets\":[[1,1,1],[2,3,2]]},"
+            "\"clade_leaves\":{\"count\":3,\"min\":1,\"max\":4,\"mean\":2.33333,\"buckets\":[[1,1,1],[2,3,1],[4,7,1]]},"
+            "\"names\":{"
+                "\"named\":6,"
+                "\"unnamed\":1,"
+                "\"bytes\":{\"count\":6,\"min\":1,\"max\":2,\"mean\":1.16667,\"buckets\":[[1,1,5],[2,3,1]]},"
+                "\"code_points\":{\"count\":6,\"min\":1,\"max\":1,\"mean\":1,\"buckets\":[[1,1,6]]},"
+                "\"non_ascii_names\":1,"
+                "\"non_ascii_bytes\":2,"
+                "\"distinct\":5,"
+                "\"duplicated\":1,"
+                "\"duplicated_nodes\":2,"
+                "\"most_duplicated\":[[\"a\",2]]"
+            "}"
+        "}"
+    );
+    assert(json.to_string() == expected);
+
+    // the simulated decomposition matches the real one
+    for (int overlap = 1; overlap <= 2; ++overlap) {
+        std::istringstream random_input(random_newick(30000, 3));
+        TreeOfLife tree(random_input);
+        TreeOfLife::DecompositionParams params;
+        params.max_subtree_sizes.clear();
+        params.max_subtree_sizes.push_back(8000);
+        params.max_subtree_sizes.push_back(2000);
+        params.min_subtree_size = 300;
+        params.max_overlap_depth = overlap;
+
+        const std::vector<int> sizes = TreeStats::decomposition_sizes(tree, params);
+        std::list<TreeOfLife> subtrees;
+        tree.iterative_decomposition(subtrees, params);
+        assert(sizes.size() == subtrees.size());
+        assert(sizes.size() > 3);
+
+        size_t i = 0;
+        for (std::list<TreeOfLife>::const_iterator itr = subtrees.begin(); itr != subtrees.end(); ++itr)
+            assert(count_nodes(*itr) == sizes[i++]);
+    }
+
+    {
+    // the prefetch hints are child subtrees, the most likely first
+    std::istringstream random_input(random_newick(30000, 3));
+    TreeOfLife tree(random_input);
+    TreeOfLife::DecompositionParams params;
+    params.max_subtree_sizes.clear();
+    params.max_subtree_sizes.push_back(8000);
+    params.max_subtree_sizes.push_back(2000);
+    params.min_subtree_size = 300;
+    params.max_prefetch_hints = 3;
+
+    std::list<TreeOfLife> subtrees;
+    TreeOfLife::PrefetchHints hints;
+    const std::map<int, int> parents = tree.iterative_decomposition(subtrees, params, &hints);
+    assert(hints.count(0) == 1);
+
+    std::map<int, int> n_children;
+    for (std::map<int, int>::const_iterator itr = parents.begin(); itr != parents.end(); ++itr)
+        n_children[itr->second]++;
+    assert(hints.size() == n_children.size());
+
+    std::vector<const TreeOfLife*> by_id;
+    for (std::list<TreeOfLife>::const_iterator itr = subtrees.begin(); itr != subtrees.end(); ++itr)
+        by_id.push_back(&*itr);
+
+    for (TreeOfLife::PrefetchHints::const_iterator itr = hints.begin(); itr != hints.end(); ++itr) {
+        const std::vector<TreeOfLife::PrefetchHint> &list = itr->second;
+        assert(int(list.size()) == std::min(3, n_children[itr->first]));
+        for (size_t i = 0; i < list.size(); ++i) {
+            assert(parents.find(list[i].subtree_id)->second == itr->first);
+            assert(list[i].total_leaves == by_id[list[i].subtree_id]->total_leaves);
+            assert(list[i].depth > 0);
+            if (i > 0) assert(list[i-1].weight() >= list[i].weight());
+        }
+    }
+    }
+
+    std::cerr << "treestats tests passed" << std::endl;
+}
+
+void run_lod_tests() {
+    
+    std::istringstream newick_input(
+        "((Raccoon_ott2,bear_ott3)land_ott1,(lion_ott5,seal_ott6),dog_ott7);"
+    );
+    TreeOfLife tol(newick_input);
+    
+    TreeOfLife::LodParams params;
+    params.max_depth = 1;
+    params.min_weight = 0.5;
+    
+    CheckedJsonWriter json;
+    tol.write_lod_json(json, params, 4);
+    
+    // the lone small leaf "dog" is not collapsed
+    assert(json.to_string() == string(
+        "{"
+            "\"data\":{"
+                "\"i\":1,"
+                "\"s\":5,"
+                "\"c\":["
+                    "{\"i\":2,\"n\":\"land\",\"s\":2,\"c\":["
+                        "{\"s\":2,\"g\":{\"k\":2,\"t\":2,\"f\":4}}"
+                    "]},"
+                    "{\"i\":5,\"s\":2,\"o\":2,\"c\":["
+                        "{\"s\":2,\"g\":{\"k\":2,\"t\":2,\"f\":4}}"
+                    "]},"
+                    "{\"i\":8,\"n\":\"dog\",\"s\":1,\"o\":4}"
+                "]"
+            "},"
+            "\"parents\":{\"2\":1,\"5\":1,\"8\":1}"
+        "}"
+    ));
+    
+    {
+    // the aggregate comes after the large children
+    const string newick("((a_ott2,b_ott3)x_ott1,c_ott4,d_ott5);");
+    TreeOfLife small(newick.data(), newick.size());
+    CheckedJsonWriter small_json;
+    small.write_lod_json(small_json, params, 0);
+    assert(small_json.to_string() == string(
+        "{\"data\":{\"i\":1,\"s\":4,\"c\":["
+            "{\"i\":2,\"n\":\"x\",\"s\":2,\"c\":[{\"s\":2,\"g\":{\"k\":2,\"t\":2,\"f\":0}}]},"
+            "{\"s\":2,\"o\":2,\"g\":{\"k\":2,\"t\":2,\"f\":0}}"
+        "]},\"parents\":{\"2\":1}}"));
+    }
+    
+    params.max_depth = 0;
+    CheckedJsonWriter root_only;
+    tol.write_lod_json(root_only, params, 0);
+    assert(root_only.to_string() == string(
+        "{\"data\":{\"i\":1,\"s\":5,\"c\":[{\"s\":5,\"g\":{\"k\":3,\"t\":7,\"f\":0}}]},"
+        "\"parents\":{}}"));
+    
+    CheckedJsonWriter root_only_v2;
+    tol.write_lod_json(root_only_v2, params, 0, 2);
+    assert(root_only_v2.to_string() == string(
+        "{\"v\":2,\"data\":{\"i\":1,\"s\":5,\"c\":[{\"s\":5,\"g\":{\"k\":3,\"t\":7,\"f\":0}}]}}"));
+    
+    // without thresholds, the LOD document is the full document
+    std::istringstream random_input(random_newick(3000, 3));
+    TreeOfLife random_tree(random_input);
+    params.max_depth = 1000000;
+    params.min_weight = 0;
+    CheckedJsonWriter full, lod;
+    random_tree.write_json(full);
+    random_tree.write_lod_json(lod, params, 0);
+    assert(lod.to_string() == full.to_string());
+    
+    std::cerr << "lod tests passed" << std::endl;
+}
+
+std::string search_trie_json(const std::string &newick, int n_threads) {
+    std::istringstream newick_input(newick);
+    TreeOfLife tol(newick_input);
+    
+    std::ostringstream log;
+    MemorySink out;
+    SearchTree search("", out, log, n_threads);
+    search.traverse_tree(tol, 0);
+    // Carnivora, after the clade with more leaves
+    search.traverse_tree(tol.children.back(), 1);
+    search.compress();
+    
+    CheckedJsonWriter json;
+    search.trie().write_json(json);
+    return json.to_string();
+}
+
+/** Renames the nodes to one of n_names names, most of which are then shared */
+void rename_nodes(TreeOfLife &tree, int n_names) {
+    tree.name = "Name" + to_string(tree.id % n_names);
+    for (std::list<TreeOfLife>::iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+        rename_nodes(*c, n_names);
+}
+
+void collect_unvisited(const TreeOfLife &tree, std::set<int> &visited,
+                       std::vector<const TreeOfLife*> &nodes) {
+    if (visited.insert(tree.id).second) nodes.push_back(&tree);
+    for (TreeOfLife::const_iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+        collect_unvisited(*c, visited, nodes);
+}
+
+bool smaller_node_id(const TreeOfLife *a, const TreeOfLife *b) { return a->id < b->id; }
+
+typedef std::map< string, std::pair<int, int> > SearchValues;
+
+/** The names of a serial build: one by one, subtree by subtree, in file order */
+SearchValues serial_search_values(const std::list<TreeOfLife> &subtrees) {
+    SearchValues values;
+    std::set<int> visited;
+    int subtree_id = 0;
+    for (std::list<TreeOfLife>::const_iterator s = subtrees.begin(); s != subtrees.end(); ++s) {
+        std::vector<const TreeOfLife*> nodes;
+        collect_unvisited(*s, visited, nodes);
+        std::sort(nodes.begin(), nodes.end(), smaller_node_id);
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const std::pair<int, int> value(nodes[i]->id, subtree_id);
+            SearchValues::const_iterator existing = values.find(nodes[i]->name);
+            if (existing == values.end()) values[nodes[i]->name] = value;
+            else if (existing->second.first != value.first)
+                values[nodes[i]->name + " (" + nodes[i]->ext_id + ")"] = value;
+        }
+        subtree_id++;
+    }
+    return values;
+}
+
+void collect_search_values(const StringTrie<SearchTree::Pointer> &trie, string &prefix,
+                           SearchValues &values) {
+    if (trie.has_value) values[prefix] = std::make_pair(trie.value.id, trie.value.subtree);
+    for (StringTrie<SearchTree::Pointer>::const_iterator c = trie.children.begin();
+        c != trie.children.end(); ++c) {
+        prefix += c->first;
+        collect_search_values(c->second, prefix, values);
+        prefix.resize(prefix.size() - c->first.size());
+    }
+}
+
+void run_search_tests() {
+    
+    const string newick(
+        "((canis_ott2,Canis_ott3,Cat_ott4)Carnivora_ott1,"
+        "(\xC3\x81rvore_ott6,zebra_ott7,\xC3\x81rbol_ott8,Canis_ott9)x_ott5)root_ott10;"
+    );
+    
+    string expected(
+        "{\"c\":{"
+            "\"Ca\":{\"c\":{"
+                "\"nis\":{\"c\":{"
+                    "\" (ott\":{\"c\":{"
+                        "\"3)\":{\"v\":[4,0]},"
+                        "\"9)\":{\"v\":[10,0]}"
+                    "}}"
+                "},\"v\":[3,0]},"
+                "\"rnivora\":{\"v\":[2,0]},"
+                "\"t\":{\"v\":[5,0]}"
+            "}},"
+            "\"Root\":{\"v\":[1,0]},"
+            "\"X\":{\"v\":[6,0]},"
+            "\"Zebra\":{\"v\":[8,0]},"
+            "\"\xC3\x81r\":{\"c\":{"
+                "\"bol\":{\"v\":[9,0]},"
+                "\"vore\":{\"v\":[7,0]}"
+            "}}"
+        "}}"
+    );
+    
+    assert(search_trie_json(newick, 1) == expected);
+    assert(search_trie_json(newick, 3) == expected);
+    assert(search_trie_json(newick, 16) == expected);
+    
+    {
+    std::istringstream newick_input(newick);
+    TreeOfLife tol(newick_input);
+    std::ostringstream log;
+    MemorySink out;
+    SearchTree search("", out, log);
+    search.traverse_tree(tol, 0);
+    assert(search.redundant_visits() == 0);
+    search.traverse_tree(tol.children.front(), 1);
+    search.traverse_tree(tol.children.back(), 2);
+    assert(search.redundant_visits() == 9);
+    }
+    
+    {
+    // completions: the names with the most leaves first, then by name
+    std::istringstream newick_input(newick);
+    TreeOfLife tol(newick_input);
+    std::ostringstream log;
+    MemorySink out;
+    SearchTree search("search-", out, log, 2, 2);
+    search.traverse_tree(tol, 0);
+    search.compress();
+    search.decompose_and_write_jsons();
+    
+    assert(out.documents.size() == 1);
+    assert(out.documents["search-0"] == string(
+        "{\"c\":{"
+            "\"Ca\":{\"c\":{"
+                "\"nis\":{\"c\":{"
+                    "\" (ott\":{\"c\":{"
+                        "\"3)\":{\"v\":[4,0]},"
+                        "\"9)\":{\"v\":[10,0]}"
+                    "},\"t\":[[\"3)\",4,0],[\"9)\",10,0]]}"
+                "},\"t\":[[\"\",3,0],[\" (ott3)\",4,0]],\"v\":[3,0]},"
+                "\"rnivora\":{\"v\":[2,0,3]},"
+                "\"t\":{\"v\":[5,0]}"
+            "},\"t\":[[\"rnivora\",2,0],[\"nis\",3,0]]},"
+            "\"Root\":{\"v\":[1,0,7]},"
+            "\"X\":{\"v\":[6,0,4]},"
+            "\"Zebra\":{\"v\":[8,0]},"
+            "\"\xC3\x81r\":{\"c\":{"
+                "\"bol\":{\"v\":[9,0]},"
+                "\"vore\":{\"v\":[7,0]}"
+            "},\"t\":[[\"bol\",9,0],[\"vore\",7,0]]}"
+        "},\"t\":[[\"Root\",1,0],[\"X\",6,0]]}"
+    ));
+    }
+    
+    {
+    // the shards match a serial build on the overlapping subtrees of a
+    // decomposition, where the ids within a subtree are not all smaller
+    // than those of the later subtrees
+    std::istringstream newick_input(random_newick(5000, 7));
+    TreeOfLife tol(newick_input);
+    rename_nodes(tol, 300);
+    TreeOfLife::DecompositionParams params;
+    params.max_subtree_sizes.clear();
+    params.max_subtree_sizes.push_back(1500);
+    params.max_subtree_sizes.push_back(400);
+    params.min_subtree_size = 50;
+    params.max_overlap_depth = 2;
+    std::list<TreeOfLife> subtrees;
+    tol.iterative_decomposition(subtrees, params);
+    assert(subtrees.size() > 5);
+    
+    const SearchValues expected = serial_search_values(subtrees);
+    for (int n_threads = 1; n_threads <= 4; n_threads += 3) {
+        std::ostringstream log;
+        MemorySink out;
+        SearchTree search("", out, log, n_threads);
+        int subtree_id = 0;
+        for (std::list<TreeOfLife>::const_iterator s = subtrees.begin(); s != subtrees.end(); ++s)
+            search.traverse_tree(*s, subtree_id++);
+        search.compress();
+        
+        SearchValues values;
+        string prefix;
+        collect_search_values(search.trie(), prefix, values);
+        assert(values == expected);
+    }
+    }
+    
+    std::cerr << "search tests passed" << std::endl;
+}
+
+void run_bloom_tests() {
+    
+    assert(BloomFilter(0, 10).size_bits() == 64);
+    assert(BloomFilter(100, 10).size_bits() == 1000);
+    assert(BloomFilter(100, 10).hashes() == 7);
+    
+    {
+    // no false negatives and about the expected false positive rate
+    const int n = 10000;
+    std::mt19937 random(42);
+    std::vector<string> added, other;
+    for (int i = 0; i < 2*n; ++i) {
+        string str;
+        const int length = 1 + random() % 12;
+        for (int j = 0; j < length; ++j) str += char('a' + random() % 26);
+        (i < n ? added : other).push_back(str);
+    }
+    std::set<string> added_set(added.begin(), added.end());
+    
+    BloomFilter filter(n, 10);
+    for (int i = 0; i < n; ++i) filter.add(added[i]);
+    for (int i = 0; i < n; ++i) assert(filter.may_contain(added[i]));
+    
+    int negatives = 0, false_positives = 0;
+    for (int i = 0; i < n; ++i) {
+        if (added_set.count(other[i])) continue;
+        negatives++;
+        if (filter.may_contain(other[i])) false_positives++;
+    }
+    // about 0.8% at 10 bits per item and 7 hashes
+    assert(false_positives < negatives * 0.02);
+    }
+    
+    {
+    // the incremental hash of a prefix is that of the prefix
+    BloomFilter::Hash hash, direct;
+    hash.update("Can");
+    hash.update("is");
+    direct.update("Canis");
+    assert(hash.h1 == direct.h1 && hash.h2 == direct.h2);
+    }
+    
+    {
+    BloomFilter filter(0, 10);
+    assert(filter.to_base64() == "AAAAAAAAAAA=");
+    filter.add("x");
+    assert(filter.to_base64().size() == 12);
+    assert(filter.to_base64() != "AAAAAAAAAAA=");
+    }
+    
+    {
+    // each search subtree gets a filter in the root unless disabled
+    const string newick(
+        "((canis_ott2,Canis_ott3,Cat_ott4)Carnivora_ott1,"
+        "(\xC3\x81rvore_ott6,zebra_ott7,\xC3\x81rbol_ott8,Canis_ott9)x_ott5)root_ott10;"
+    );
+    std::istringstream newick_input(newick);
+    TreeOfLife tol(newick_input);
+    
+    SearchTree::SubtreeParams params;
+    params.max_subtree_size = 4;
+    params.min_subtree_size = 1;
+    for (int filter_bytes = 0; filter_bytes <= 64; filter_bytes += 64) {
+        params.filter_bytes = filter_bytes;
+        std::ostringstream log;
+        MemorySink out;
+        SearchTree search("search-", out, log, 1, 0, params);
+        search.traverse_tree(tol, 0);
+        search.compress();
+        search.decompose_and_write_jsons();
+        
+        assert(out.documents.size() == 8);
+        const string &root = out.documents["search-0"];
+        size_t n_filters = 0;
+        for (size_t p = root.find("\"b\":{\"l\":"); p != string::npos; p = root.find("\"b\":{", p + 1))
+            n_filters++;
+        // only "Ca|nis" and "\xC3\x81r" have names below their subtree roots
+        assert(n_filters == (filter_bytes > 0 ? 2 : 0));
+    }
+    }
+    
+    std::cerr << "bloom tests passed" << std::endl;
+}
+
+/** Overwrites a 32-bit field of node i in a snapshot file */
+void patch_snapshot_node(const char *filename, size_t i, size_t field, uint32_t value) {
+    std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(sizeof(TreeSnapshot::Header) + i*sizeof(TreeSnapshot::Node) + field);
+    file.write((const char*)&value, sizeof(value));
+}
+
+void run_snapshot_tests() {
+
+    const string path = temp_path("snapshot.tmp");
+    const char *filename = path.c_str();
+
+    std::istringstream newick_input(
+        "((Raccoon_ott2,'_bear_ott3')land_ott1,('''sEA''_lion_ott5',seal_ott6),'(dog),;_ott7');"
+    );
+    TreeOfLife tol(newick_input);
+    TreeSnapshot::write(tol, filename);
+
+    {
+    TreeSnapshot snapshot(filename);
+    assert(snapshot.size() == 8);
+    assert(snapshot.node(0).total_leaves == 5);
+    assert(snapshot.first_child(0) == 1);
+    assert(snapshot.next_sibling(0, 1) == 4);
+    assert(snapshot.next_sibling(0, 4) == 7);
+    assert(snapshot.next_sibling(0, 7) == snapshot.size());
+    assert(snapshot.first_child(2) == snapshot.size());
+    assert(string(snapshot.name(5)) == "'sEA' lion");
+    assert(string(snapshot.ext_id(5)) == "ott5");
+
+    CheckedJsonWriter original, restored;
+    tol.write_json(original);
+    snapshot.to_tree().write_json(restored);
+    assert(original.to_string() == restored.to_string());
+    
+    CheckedJsonWriter full, cut, limited;
+    snapshot.write_json(full, 0, 100, 100);
+    assert(original.to_string().find(full.to_string()) == 8);
+    
+    snapshot.write_json(cut, 1, 0, 100);
+    assert(cut.to_string() == "{\"i\":2,\"n\":\"land\",\"s\":2,\"more\":true}");
+    
+    snapshot.write_json(limited, 0, 100, 7);
+    assert(limited.to_string() == string(
+        "{\"i\":1,\"s\":5,\"c\":["
+            "{\"i\":2,\"n\":\"land\",\"s\":2,\"c\":["
+                "{\"i\":3,\"n\":\"Raccoon\",\"s\":1},{\"i\":4,\"n\":\"bear\",\"s\":1,\"o\":1}"
+            "]},"
+            "{\"i\":5,\"s\":2,\"o\":2,\"more\":true},"
+            "{\"i\":8,\"n\":\"(dog),;\",\"s\":1,\"o\":4}"
+        "]}"));
+    }
+
+    // without the checksum, broken nodes are still caught
+    const size_t TOTAL_NODES = offsetof(TreeSnapshot::Node, total_nodes);
+    const size_t NAME = offsetof(TreeSnapshot::Node, name);
+    patch_snapshot_node(filename, 3, TOTAL_NODES, 0);
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename, false));
+    patch_snapshot_node(filename, 3, TOTAL_NODES, 2);
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename, false));
+    patch_snapshot_node(filename, 3, TOTAL_NODES, 1);
+    patch_snapshot_node(filename, 0, TOTAL_NODES, 100);
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename, false));
+    patch_snapshot_node(filename, 0, TOTAL_NODES, 8);
+    patch_snapshot_node(filename, 5, NAME, 1u << 30);
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename, false));
+    TreeSnapshot::write(tol, filename);
+    { TreeSnapshot snapshot(filename, false); }
+
+    {
+    std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(-2, std::ios::end);
+    file.put('X');
+    }
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename));
+
+    std::remove(filename);
+    ASSERT_THROWS(TreeSnapshot::error, TreeSnapshot snapshot(filename));
+
+    // the decomposition of the mapped nodes gives the same subtrees, hints,
+    // documents and search names as that of the pointer tree
+    for (int overlap = 1; overlap <= 2; ++overlap) {
+        std::istringstream random_input(random_newick(30000, 3));
+        TreeOfLife tree(random_input);
+        rename_nodes(tree, 2000);
+        // before the decomposition trims the tree
+        const TreeSnapshot snapshot(tree);
+
+        TreeOfLife::DecompositionParams params;
+        params.max_subtree_sizes.clear();
+        params.max_subtree_sizes.push_back(8000);
+        params.max_subtree_sizes.push_back(2000);
+        params.min_subtree_size = 300;
+        params.max_overlap_depth = overlap;
+        params.max_prefetch_hints = 3;
+
+        std::list<TreeOfLife> subtrees;
+        TreeOfLife::PrefetchHints hints;
+        const std::map<int, int> parents = tree.iterative_decomposition(subtrees, params, &hints);
+
+        std::vector<TreeSnapshot::Subtree> mapped;
+        TreeOfLife::PrefetchHints mapped_hints;
+        assert(snapshot.iterative_decomposition(mapped, params, &mapped_hints) == parents);
+        assert(mapped.size() == subtrees.size());
+        assert(mapped.size() > 5);
+
+        assert(mapped_hints.size() == hints.size());
+        for (TreeOfLife::PrefetchHints::const_iterator itr = hints.begin(); itr != hints.end(); ++itr) {
+            const std::vector<TreeOfLife::PrefetchHint> &mine = mapped_hints[itr->first];
+            assert(mine.size() == itr->second.size());
+            for (size_t i = 0; i < mine.size(); ++i) {
+                assert(mine[i].subtree_id == itr->second[i].subtree_id);
+                assert(mine[i].total_leaves == itr->second[i].total_leaves);
+                assert(mine[i].depth == itr->second[i].depth);
+            }
+        }
+
+        std::ostringstream log;
+        MemorySink out;
+        SearchTree search("", out, log), mapped_search("", out, log);
+        TreeOfLife::LodParams lod_params;
+        lod_params.max_depth = 3;
+
+        int subtree_id = 0;
+        for (std::list<TreeOfLife>::const_iterator itr = subtrees.begin(); itr != subtrees.end();
+            ++itr, ++subtree_id) {
+            const TreeSnapshot::Subtree &subtree = mapped[subtree_id];
+            for (int schema = 1; schema <= 2; ++schema) {
+                CheckedJsonWriter expected, json;
+                itr->write_json(expected, schema);
+                subtree.write_json(json, schema);
+                assert(json.to_string() == expected.to_string());
+
+                CheckedJsonWriter expected_lod, lod_json;
+                itr->write_lod_json(expected_lod, lod_params, subtree_id, schema);
+                subtree.write_lod_json(lod_json, lod_params, subtree_id, schema);
+                assert(lod_json.to_string() == expected_lod.to_string());
+            }
+            search.traverse_tree(*itr, subtree_id);
+            mapped_search.traverse_tree(subtree, subtree_id);
+        }
+        assert(mapped_search.redundant_visits() == search.redundant_visits());
+
+        search.compress();
+        mapped_search.compress();
+        CheckedJsonWriter expected, json;
+        search.trie().write_json(expected);
+        mapped_search.trie().write_json(json);
+        assert(json.to_string() == expected.to_string());
+    }
+
+    std::cerr << "snapshot tests passed" << std::endl;
+}
+
+void run_http_tests() {
+    
+    HttpServer::Request request;
+    assert(HttpServer::parse_request(
+        "GET /search?q=Canis+lupus%20f&limit=5&x HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Connection: close\r\n", request));
+    
+    assert(request.method == "GET");
+    assert(request.path == "/search");
+    assert(request.param("q") == "Canis lupus f");
+    assert(request.int_param("limit", 10) == 5);
+    assert(request.int_param("depth", 2) == 2);
+    assert(request.query.count("x") == 1);
+    assert(!request.keep_alive);
+    
+    assert(HttpServer::parse_request("GET /node HTTP/1.1\r\n", request));
+    assert(request.path == "/node");
+    assert(request.keep_alive);
+    
+    assert(!HttpServer::parse_request("garbage\r\n", request));
+    
+    assert(HttpServer::url_decode("a%2Fb%2f") == "a/b/");
+    assert(HttpServer::url_decode("100%zz%4") == "100%zz%4");
+    assert(HttpServer::url_decode("%g1%41") == "%g1A");
+    
+    std::cerr << "http tests passed" << std::endl;
+}
+
+void run_ancestry_tests() {
+    
+    std::istringstream newick_input(random_newick(700, 1));
+    TreeOfLife tol(newick_input);
+    AncestorIndex index(tol);
+    
+    assert(int(index.size()) == tol.total_nodes);
+    assert(index.depth(1) == 0);
+    assert(index.parent(1) == -1);
+    assert(!index.contains(0));
+    assert(!index.contains(701));
+    ASSERT_THROWS(AncestorIndex::error, index.depth(701));
+    
+    for (int a = 1; a <= tol.total_nodes; a += 3) {
+        std::vector<int> path_a = index.path_to_root(a);
+        assert(int(path_a.size()) == index.depth(a) + 1);
+        assert(path_a.back() == 1);
+        
+        for (int b = 1; b <= tol.total_nodes; ++b) {
+            std::vector<int> path_b = index.path_to_root(b);
+            
+            // naive LCA: the deepest common node of the paths
+            int expected = 1;
+            for (size_t i = 1; i <= std::min(path_a.size(), path_b.size()); ++i) {
+                if (path_a[path_a.size()-i] != path_b[path_b.size()-i]) break;
+                expected = path_a[path_a.size()-i];
+            }
+            
+            assert(index.lca(a, b) == expected);
+            assert(index.is_ancestor(a, b) == (expected == a));
+        }
+    }
+    
+    // subtree ids as returned by iterative_decomposition
+    std::map<int,int> subtree_parents;
+    subtree_parents[1] = 0;
+    subtree_parents[2] = 1;
+    subtree_parents[3] = 0;
+    subtree_parents[4] = 2;
+    AncestorIndex subtrees(subtree_parents, 0);
+    assert(subtrees.size() == 5);
+    assert(subtrees.path_to_root(4) == std::vector<int>({4, 2, 1, 0}));
+    assert(subtrees.path_to_root(0) == std::vector<int>(1, 0));
+    assert(subtrees.lca(4, 3) == 0);
+    assert(subtrees.lca(4, 1) == 1);
+    
+    subtree_parents[5] = 6;
+    subtree_parents[6] = 5;
+    ASSERT_THROWS(AncestorIndex::error, AncestorIndex cycle(subtree_parents, 0));
+    
+    std::cerr << "ancestry tests passed" << std::endl;
+}
+
+string read_file(const string &filename) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    return oss.str();
+}
+
+void run_pack_tests() {
+    
+    std::istringstream newick_input(random_newick(5000, 2));
+    TreeOfLife tol(newick_input);
+    std::list<TreeOfLife> subtrees;
+    subtrees.push_back(tol);
+    
+    const string prefix = temp_path("");
+    DirectorySink files(prefix);
+    std::vector<string> names;
+    
+    {
+    PackSink pack(prefix + "pack");
+    std::ostringstream log;
+    
+    for (int i = 0; i < 3; ++i) {
+        for (int n = 0; n < 2; ++n) {
+            OutputSink &out = n == 0 ? (OutputSink&)files : (OutputSink&)pack;
+            
+            SearchTree search("search-" + to_string(i) + "-", out, log, 2);
+            search.traverse_tree(subtrees.back(), 0);
+            search.compress();
+            search.decompose_and_write_jsons();
+            write_json_tree(subtrees.back(), "subtree-" + to_string(i), out, log);
+        }
+        names.push_back("subtree-" + to_string(i));
+        names.push_back("search-" + to_string(i) + "-0");
+        subtrees.push_back(subtrees.back().children.front());
+    }
+    
+    ASSERT_THROWS(OutputSink::error, pack.write(names[0], "{}"));
+    pack.finish();
+    }
+    
+    PackReader reader(prefix + "pack");
+    for (size_t i = 0; i < names.size(); ++i) assert(reader.contains(names[i]));
+    
+    // also the search subtrees
+    names = reader.names();
+    assert(names.size() > 6);
+    
+    for (size_t i = 0; i < names.size(); ++i) {
+        const string standalone = read_file(files.path(names[i]));
+        assert(standalone.size() > 2);
+        assert(reader.read(names[i]) == standalone);
+        std::remove(files.path(names[i]).c_str());
+    }
+    ASSERT_THROWS(PackReader::error, reader.read("subtree-3"));
+    
+    std::remove(PackSink::pack_file(prefix + "pack").c_str());
+    std::remove(PackSink::index_file(prefix + "pack").c_str());
+    
+    // the index cannot be written over a directory
+    {
+    PackSink pack(prefix + "unwritable");
+    const string index = PackSink::index_file(prefix + "unwritable");
+    assert(mkdir(index.c_str(), 0700) == 0);
+    ASSERT_THROWS(OutputSink::error, pack.finish());
+    rmdir(index.c_str());
+    std::remove(PackSink::pack_file(prefix + "unwritable").c_str());
+    }
+    
+    std::cerr << "pack tests passed" << std::endl;
+}
+
+void run_async_output_tests() {
+    
+    const string prefix = temp_path("async-");
+    std::vector<string> payloads;
+    for (int i = 0; i < 200; ++i) payloads.push_back(string(i * 997 % 70000, 'a' + i % 26));
+    
+    for (int b = 0; b < 2; ++b) {
+        AsyncDirectorySink::Backend backend =
+            b == 0 ? AsyncDirectorySink::IO_URING : AsyncDirectorySink::THREAD;
+        
+        // a small pending limit to exercise the backpressure
+        AsyncDirectorySink out(prefix, backend, AsyncDirectorySink::FSYNC_END, 100000);
+        for (size_t i = 0; i < payloads.size(); ++i) out.write(to_string(i), payloads[i]);
+        out.finish();
+        
+        for (size_t i = 0; i < payloads.size(); ++i) {
+            const string filename = prefix + to_string(i) + ".json";
+            assert(read_file(filename) == payloads[i]);
+            std::remove(filename.c_str());
+        }
+    }
+    
+    // more entries than the submission queue holds
+    try {
+        IoUring ring(4);
+        const unsigned n = ring.size() + 3;
+        for (unsigned i = 0; i < n; ++i) ring.acquire_sqe()->user_data = i;
+        ring.submit(0);
+        std::set<unsigned long long> completed;
+        io_uring_cqe cqe;
+        while (completed.size() < n) {
+            while (!ring.next_cqe(cqe)) ring.submit(1);
+            assert(cqe.res == 0);
+            completed.insert(cqe.user_data);
+        }
+        assert(*completed.rbegin() == n - 1);
+    }
+    catch (IoUring::error &) {}
+    
+    AsyncDirectorySink missing(temp_path("no-such-directory/"));
+    missing.write("subtree-0", "{}");
+    ASSERT_THROWS(OutputSink::error, missing.finish());
+    
+    assert(AsyncDirectorySink::parse_fsync_policy("each") == AsyncDirectorySink::FSYNC_EACH);
+    ASSERT_THROWS(OutputSink::error, AsyncDirectorySink::parse_fsync_policy("always"));
+    
+    std::cerr << "async output tests passed" << std::endl;
+}
+
+// every allocation goes through the counting operator new below
+static std::atomic<long long> n_allocations(0);
+
+// not inlined, so the compiler does not pair new with free
+__attribute__((noinline)) void *operator new(size_t size) {
+    n_allocations++;
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+void collect_names(const TreeOfLife &tree, std::vector<string> &names) {
+    if (tree.name.size() > 0) names.push_back(tree.name);
+    for (TreeOfLife::const_iterator c = tree.children.begin(); c != tree.children.end(); ++c)
+        collect_names(*c, names);
+}
+
+void run_allocation_tests() {
+
+    const string newick = random_newick(20000, 11);
+
+    long long before = n_allocations;
+    TreeOfLife tree(newick.data(), newick.size());
+    const double per_node = double(n_allocations - before) / tree.total_nodes;
+
+    std::vector<string> names;
+    collect_names(tree, names);
+
+    UnicodeTrie<int> trie;
+    before = n_allocations;
+    for (size_t i = 0; i < names.size(); ++i) trie.insert(names[i], int(i), true);
+    const double per_insert = double(n_allocations - before) / names.size();
+
+    before = n_allocations;
+    for (size_t i = 0; i < names.size(); ++i) assert(trie.lookup(names[i]) != NULL);
+    const double per_lookup = double(n_allocations - before) / names.size();
+
+    std::cerr << "allocations: " << per_node << " per parsed node, "
+              << per_insert << " per inserted name, "
+              << per_lookup << " per lookup" << std::endl;
+
+    // a list node and the name, at most one map node per new trie node;
+    // the same code with the headers before the moves, string views and
+    // in-place construction made 2.9 per parsed node, 5.5 per inserted
+    // name and 4.5 per lookup
+    assert(per_node < 2.5);
+    assert(per_insert < 1.5);
+    assert(per_lookup == 0);
+
+    std::cerr << "allocation tests passed" << std::endl;
+}
+
+/** Sums 1..n by splitting the range into tasks down to ranges of grain */
+void sum_range(WorkStealingScheduler &scheduler, int worker, long first, long last,
+               long grain, std::atomic<long> &sum) {
+    while (last - first > grain) {
+        const long middle = first + (last - first) / 2;
+        scheduler.spawn([&scheduler, middle, last, grain, &sum](int w) {
+            sum_range(scheduler, w, middle, last, grain, sum);
+        }, worker);
+        last = middle;
+    }
+    long partial = 0;
+    for (long i = first; i < last; ++i) partial += i;
+    sum += partial;
+}
+
+void run_parallel_tests() {
+    
+    for (int n_threads = 1; n_threads <= 4; ++n_threads) {
+        WorkStealingScheduler scheduler(n_threads);
+        std::atomic<long> sum(0);
+        scheduler.spawn([&scheduler, &sum](int w) { sum_range(scheduler, w, 1, 100001, 100, sum); });
+        scheduler.run();
+        assert(sum == 100000L * 100001 / 2);
+        if (n_threads == 1) assert(scheduler.steals() == 0);
+        
+        // the scheduler can be reused, and an exception stops nothing else
+        std::atomic<int> n_run(0);
+        for (int i = 0; i < 10; ++i) {
+            scheduler.spawn([&n_run, i](int) {
+                n_run++;
+                if (i == 3) throw std::runtime_error("task 3");
+            });
+        }
+        ASSERT_THROWS(std::runtime_error, scheduler.run());
+        assert(n_run == 10);
+        
+        // many short runs on the same pool, which sleeps in between
+        for (int r = 0; r < 200; ++r) {
+            std::atomic<long> small_sum(0);
+            scheduler.spawn([&scheduler, &small_sum](int w) {
+                sum_range(scheduler, w, 1, 1001, 10, small_sum);
+            });
+            scheduler.run();
+            assert(small_sum == 1000L * 1001 / 2);
+        }
+    }
+    
+    // subtree ids, parents and hints of the serial preorder decomposition,
+    // worked out by hand: the children of A are in display order G, C
+    for (int n_threads = 1; n_threads <= 4; n_threads *= 2) {
+        const string newick(
+            "(((a_ott4,b_ott5)C_ott3,(d_ott7,e_ott8,f_ott9)G_ott6)A_ott2,"
+            "((h_ott12,i_ott13)K_ott11,j_ott14)H_ott10,(l_ott16,m_ott17)N_ott15)R_ott1;");
+        TreeOfLife tree(newick.data(), newick.size());
+        TreeOfLife::DecompositionParams params;
+        params.max_subtree_sizes.clear();
+        params.max_subtree_sizes.push_back(5);
+        params.max_subtree_sizes.push_back(3);
+        params.min_subtree_size = 2;
+        params.n_threads = n_threads;
+        
+        std::list<TreeOfLife> subtrees;
+        TreeOfLife::PrefetchHints hints;
+        const std::map<int, int> parents = tree.iterative_decomposition(subtrees, params, &hints);
+        
+        const int expected_roots[] = { 1, 6, 3, 10, 15, 11 };
+        const size_t expected_names[] = { 15, 4, 3, 5, 3, 3 };
+        assert(subtrees.size() == 6);
+        std::list<TreeOfLife>::const_iterator subtree = subtrees.begin();
+        for (int i = 0; i < 6; ++i, ++subtree) {
+            std::vector<string> names;
+            collect_names(*subtree, names);
+            assert(subtree->id == expected_roots[i]);
+            assert(names.size() == expected_names[i]);
+        }
+        
+        std::map<int, int> expected_parents;
+        expected_parents[1] = expected_parents[2] = expected_parents[3] = expected_parents[4] = 0;
+        expected_parents[5] = 3;
+        assert(parents == expected_parents);
+        
+        // weights 3/2, 2/2, 3/4 and 2/4
+        const int expected_hints[] = { 3, 4, 1, 2 };
+        assert(hints.size() == 2 && hints[0].size() == 4 && hints[3].size() == 1);
+        for (int i = 0; i < 4; ++i) assert(hints[0][i].subtree_id == expected_hints[i]);
+        assert(hints[3][0].subtree_id == 5 && hints[3][0].depth == 1);
+    }
+    
+    // the decomposition does not depend on the threads
+    std::string expected;
+    for (int n_threads = 1; n_threads <= 4; n_threads *= 2) {
+        std::istringstream random_input(random_newick(60000, 3));
+        TreeOfLife tree(random_input);
+        TreeOfLife::DecompositionParams params;
+        params.max_subtree_sizes.clear();
+        params.max_subtree_sizes.push_back(20000);
+        params.max_subtree_sizes.push_back(5000);
+        params.min_subtree_size = 500;
+        params.max_overlap_depth = 2;
+        params.n_threads = n_threads;
+        
+        std::list<TreeOfLife> subtrees;
+        TreeOfLife::PrefetchHints hints;
+        const std::map<int, int> parents = tree.iterative_decomposition(subtrees, params, &hints);
+        assert(subtrees.size() > 10);
+        
+        CheckedJsonWriter json;
+        json.begin('[');
+        for (std::list<TreeOfLife>::const_iterator itr = subtrees.begin(); itr != subtrees.end(); ++itr)
+            itr->write_json(json);
+        for (std::map<int, int>::const_iterator itr = parents.begin(); itr != parents.end(); ++itr)
+            json.value(itr->first).value(itr->second);
+        for (TreeOfLife::PrefetchHints::const_iterator itr = hints.begin(); itr != hints.end(); ++itr) {
+            for (size_t i = 0; i < itr->second.size(); ++i)
+                json.value(itr->first).value(itr->second[i].subtree_id).value(itr->second[i].depth);
+        }
+        json.end(']');
+        
+        if (n_threads == 1) expected = json.to_string();
+        else assert(json.to_string() == expected);
+    }
+    
+    std::cerr << "parallel tests passed" << std::endl;
+}
+
 void run_misc_tests() {
     
     assert(to_string(123) == string("123"));
@@ -231,9 +1408,25 @@ void run_misc_tests() {
 
 int main() {
     run_misc_tests();
+    run_parallel_tests();
     run_json_tests();
     run_trie_tests();
+    run_newick_tests();
     run_tree_of_life_tests();
+    run_extract_tests();
+    run_treestats_tests();
+    run_lod_tests();
+    run_search_tests();
+    run_bloom_tests();
+    run_snapshot_tests();
+    run_http_tests();
+    run_ancestry_tests();
+    run_pack_tests();
+    run_async_output_tests();
+    run_allocation_tests();
+    
+    // fails if a test left a file behind
+    assert(temp_dir.empty() || rmdir(temp_dir.c_str()) == 0);
     
     std::cerr << "all passed" << std::endl;
     return 0;
@@ -0,0 +1,178 @@
+#include <tree.hpp>
+#include <treestats.hpp>
+#include <search.hpp>
+#include <output.hpp>
+#include <json.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Statistics of a Newick tree and of the documents bin/main would split it
+ * into, as one JSON object on stdout. The decomposition parameters can be
+ * changed to compare their subtree counts and sizes.
+ */
+struct Options {
+    TreeOfLife::DecompositionParams decomposition;
+    SearchTree::SubtreeParams search_subtrees;
+    bool search;
+    size_t top_k;
+
+    Options() : search(false), top_k(5) {}
+
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (i + 1 < argc && arg == "--max-subtree-sizes") {
+                if (!parse_sizes(argv[++i], decomposition.max_subtree_sizes)) return false;
+            }
+            else if (i + 1 < argc && arg == "--min-subtree-size")
+                decomposition.min_subtree_size = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--overlap-depth")
+                decomposition.max_overlap_depth = atoi(argv[++i]);
+            else if (arg == "--search") search = true;
+            else if (i + 1 < argc && arg == "--search-max-size")
+                search_subtrees.max_subtree_size = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--search-min-size")
+                search_subtrees.min_subtree_size = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--search-filter-bytes")
+                search_subtrees.filter_bytes = atoi(argv[++i]);
+            else if (i + 1 < argc && arg == "--top-k") top_k = atoi(argv[++i]);
+            else return false;
+        }
+        return decomposition.max_overlap_depth >= 1;
+    }
+
+    static bool parse_sizes(const std::string &list, std::vector<int> &sizes) {
+        sizes.clear();
+        std::istringstream iss(list);
+        std::string size;
+        while (std::getline(iss, size, ',')) {
+            sizes.push_back(atoi(size.c_str()));
+            if (sizes.back() < 1) return false;
+        }
+        return true;
+    }
+
+    static void usage(std::ostream &os) {
+        os << "usage: bin/treestats [options] < data/source.tre" << std::endl
+           << "  --max-subtree-sizes N,N,...  one decomposition iteration per size (default 500000,100000,50000)" << std::endl
+           << "  --min-subtree-size N         smallest clade split off (default 10000)" << std::endl
+           << "  --overlap-depth N            levels of a split clade kept in its parent (default 1)" << std::endl
+           << "  --search                     also build the search index and measure its subtrees" << std::endl
+           << "  --search-max-size N          largest search subtree in trie nodes (default 120000)" << std::endl
+           << "  --search-min-size N          smallest search subtree in trie nodes (default 2000)" << std::endl
+           << "  --search-filter-bytes N      prefix filter per search subtree (default 2048)" << std::endl
+           << "  --top-k K                    completions per search trie node (default 5)" << std::endl;
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point begin) {
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+template <class Writer>
+void write_decomposition_json(Writer &json, const TreeOfLife &tree,
+                              const TreeOfLife::DecompositionParams &params) {
+    const std::vector<int> sizes = TreeStats::decomposition_sizes(tree, params);
+    Histogram nodes;
+    for (size_t i = 0; i < sizes.size(); ++i) nodes.add(sizes[i]);
+
+    json.begin('{');
+    json.key("max_subtree_sizes").begin('[');
+    for (size_t i = 0; i < params.max_subtree_sizes.size(); ++i)
+        json.value(params.max_subtree_sizes[i]);
+    json.end(']');
+    json.key("min_subtree_size").value(params.min_subtree_size)
+        .key("max_overlap_depth").value(params.max_overlap_depth)
+        .key("subtrees").value(int(sizes.size()))
+        .key("nodes").value(nodes);
+    json.end('}');
+}
+
+/** Builds the search index of the whole tree and formats it without writing it */
+template <class Writer>
+void write_search_json(Writer &json, const TreeOfLife &tree, const Options &options) {
+    SizeSink sizes;
+    std::ostringstream log;
+    {
+        SearchTree search("search-", sizes, log, default_thread_count(),
+                          options.top_k, options.search_subtrees);
+        search.traverse_tree(tree, 0);
+        search.compress();
+        search.decompose_and_write_jsons();
+    }
+
+    Histogram bytes;
+    long long root_bytes = 0;
+    for (std::map<std::string, size_t>::const_iterator itr = sizes.sizes.begin();
+        itr != sizes.sizes.end(); ++itr) {
+        if (itr->first == "search-0") root_bytes = itr->second;
+        else bytes.add(itr->second);
+    }
+
+    json.begin('{')
+        .key("max_subtree_size").value(options.search_subtrees.max_subtree_size)
+        .key("min_subtree_size").value(options.search_subtrees.min_subtree_size)
+        .key("filter_bytes").value(options.search_subtrees.filter_bytes)
+        .key("top_k").value(int(options.top_k))
+        .key("subtrees").value(int(bytes.count))
+        .key("root_bytes").value(root_bytes)
+        .key("bytes").value(bytes)
+    .end('}');
+}
+
+int main(int argc, char *argv[]) {
+
+    using std::endl;
+
+    std::ostream &log = std::cerr;
+
+    Options options;
+    if (!options.parse(argc, argv)) {
+        Options::usage(log);
+        return 1;
+    }
+
+    JsonStreamWriter json(std::cout);
+    json.begin('{');
+
+    log << "reading Newick tree from stdin..." << endl;
+    Clock::time_point begin = Clock::now();
+    TreeOfLife tree(std::cin);
+    const double parse_seconds = seconds_since(begin);
+
+    begin = Clock::now();
+    json.key("tree").value(TreeStats(tree));
+    const double stats_seconds = seconds_since(begin);
+
+    begin = Clock::now();
+    json.key("decomposition");
+    write_decomposition_json(json, tree, options.decomposition);
+    const double decomposition_seconds = seconds_since(begin);
+
+    double search_seconds = 0;
+    if (options.search) {
+        log << "building the search index..." << endl;
+        begin = Clock::now();
+        json.key("search");
+        write_search_json(json, tree, options);
+        search_seconds = seconds_since(begin);
+    }
+
+    json.key("seconds").begin('{')
+        .key("parse").value(parse_seconds)
+        .key("stats").value(stats_seconds)
+        .key("decomposition").value(decomposition_seconds);
+    if (options.search) json.key("search").value(search_seconds);
+    json.end('}');
+
+    json.end('}');
+    std::cout << endl;
+}
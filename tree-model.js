@@ -5,11 +5,19 @@ function TreeOfLifeBackend(root_loaded_callback) {
     var subtrees = {};
     var parent_map = {};
     
+    // full_nodes[subtree_id][node_id]: the nodes of the full subtree
+    // documents behind the aggregates of level-of-detail subtrees
+    var full_nodes = {};
+    
     var request_counter = 0;
     
+    // bytes of the child subtrees listed in subtree-index.json that are
+    // loaded ahead after a subtree is entered
+    var PREFETCH_BUDGET = 4e6;
+    
     function getJson(base_name, callback) {
         request_counter += 1;
-        d3.json('data/' + base_name + '.json', function (error, data) {
+        data_source.json(base_name, function (error, data) {
             if (error) return console.warn(error);
             request_counter -= 1;
             callback(data);
@@ -21,41 +29,145 @@ function TreeOfLifeBackend(root_loaded_callback) {
         return !!subtree && !!subtree.data;
     };
     
+    function hasLod(subtree_id) {
+        var subtree = subtrees[''+subtree_id];
+        return !!subtree && !!subtree.lod;
+    }
+    
+    function fullLoaded(subtree_id) {
+        return !hasLod(subtree_id) || !!full_nodes[''+subtree_id];
+    }
+    
+    /* Schema 1 documents list the parents, in schema 2 ("v": 2) they are
+     * implied by the nesting */
+    function addParents(data) {
+        if (data.parents) {
+            for (var key in data.parents) {
+                parent_map[key] = data.parents[key];
+            }
+            return;
+        }
+        var stack = [data.data];
+        while (stack.length > 0) {
+            var node = stack.pop();
+            if (!node.c) continue;
+            for (var i = 0; i < node.c.length; i++) {
+                var child = node.c[i];
+                if (child.i !== undefined) parent_map[''+child.i] = node.i;
+                stack.push(child);
+            }
+        }
+    }
+    
+    function indexNodes(root) {
+        var nodes = {};
+        var stack = [root];
+        while (stack.length > 0) {
+            var node = stack.pop();
+            nodes[''+node.i] = node;
+            if (node.c) stack.push.apply(stack, node.c);
+        }
+        return nodes;
+    }
+    
+    /* Loads a subtree document once, whoever asks first. A prefetch
+     * (callback null) is not a pending request until something waits
+     * for it. If loading fails, the callbacks are dropped and the next
+     * call loads it again. */
+    function load(subtree_id, callback) {
+        var subtree = subtrees[subtree_id];
+        var started = !!subtree.waiting;
+        if (!started) subtree.waiting = [];
+        if (callback) {
+            if (subtree.waiting.length === 0) request_counter += 1;
+            subtree.waiting.push(callback);
+        }
+        if (started) return;
+        
+        var name = 'subtree-' + subtree_id;
+        if (hasLod(subtree_id)) name += '-lod';
+        data_source.json(name, function (error, data) {
+            var waiting = subtree.waiting;
+            delete subtree.waiting;
+            if (waiting.length > 0) request_counter -= 1;
+            // the next fetch of the subtree tries again
+            if (error) return console.warn(error);
+            subtree.data = data.data;
+            addParents(data);
+            waiting.forEach(function (callback) { callback(data.data); });
+        });
+    }
+    
+    /* Starts loading the likeliest next subtrees, see TreeOfLife::PrefetchHint */
+    function prefetch(subtree_id) {
+        var hints = subtrees[subtree_id].prefetch || [];
+        var budget = PREFETCH_BUDGET;
+        for (var i = 0; i < hints.length; i++) {
+            var child_id = ''+hints[i][0], bytes = hints[i][1];
+            if (subtreeLoaded(child_id) || subtrees[child_id].waiting) continue;
+            if (bytes > budget) continue;
+            budget -= bytes;
+            load(child_id, null);
+        }
+    }
+    
     this.fetch = function (subtree_id, callback) {
         subtree_id = ''+subtree_id;
         if (subtreeLoaded(subtree_id)) return subtrees[subtree_id].data;
+        load(subtree_id, function (data) {
+            callback(data);
+            prefetch(subtree_id);
+        });
+        return false;
+    };
+    
+    /* Loads the full detail behind the aggregate nodes of a subtree,
+     * returns true if it is already loaded */
+    this.fetchFull = function (subtree_id, callback) {
+        subtree_id = ''+subtree_id;
+        if (fullLoaded(subtree_id)) return true;
         getJson('subtree-' + subtree_id, function (data) {
-            subtrees[subtree_id].data = data.data;
-            for (var key in data.parents) {
-                parent_map[key] = data.parents[key];
-            }
-            callback(data.data);
+            full_nodes[subtree_id] = indexNodes(data.data);
+            addParents(data);
+            callback();
         });
         return false;
     };
     
+    this.fullNode = function (subtree_id, node_id) {
+        var nodes = full_nodes[''+subtree_id];
+        if (!nodes) return undefined;
+        return nodes[''+node_id];
+    };
+    
     this.fetchWithParents = function(id, callback) {
-        var path = [id];
+        var path = subtrees[''+id].path;
         
-        while (true) {
-            id = subtrees[''+id].parent;
-            if (id === undefined) break;
-            path.push(id);
+        if (path === undefined) {
+            path = [id];
+            while (true) {
+                id = subtrees[''+id].parent;
+                if (id === undefined) break;
+                path.push(id);
+            }
         }
         
         function check() {
             for (var i in path) {
-                if (!subtreeLoaded(path[i])) return false;
+                if (!subtreeLoaded(path[i]) || !fullLoaded(path[i])) return false;
             }
             return true;
         }
         
         if (check()) return true;
         
+        function checkAndCallback() {
+            if (check()) callback();
+        }
+        
         for(var i in path) {
-            this.fetch(path[i], function(data) {
-                if (check()) callback();
-            });
+            this.fetch(path[i], checkAndCallback);
+            this.fetchFull(path[i], checkAndCallback);
         }
         return false;
     }
@@ -106,6 +218,8 @@ TreeOfLifeModel.prototype.newArtificialBranch = function(children) {
         artificial: true,
         n: "(" + children.length + " more)",
         c: children,
+        // in its place in the file order, if the children are
+        o: children.length > 0 ? children[0].o : undefined,
         s: d3.sum(children, function (c) {
             if (c.s) return c.s;
             return 1;
@@ -113,19 +227,35 @@ TreeOfLifeModel.prototype.newArtificialBranch = function(children) {
     };
 }
 
+/* True if the nodes are consecutive siblings in the order of the subtree
+ * files, which is the display order: the most leaves first, then by name.
+ * Their positions are then given by their leaf offsets "o" */
+TreeOfLifeModel.prototype.inFileOrder = function(data) {
+    var offset = data.length > 0 ? data[0].o || 0 : 0;
+    for (var i = 0; i < data.length; i++) {
+        if ((data[i].o || 0) !== offset) return false;
+        offset += data[i].s;
+    }
+    return true;
+}
+
 TreeOfLifeModel.prototype.collapseLargeLevels = function(data) {
     
-    data.forEach(function (d) {if (!d.s) d.s = 1;});
-    
     if (data.length < 20) return data;
     
-    var that = this;
-    data.sort(function (a,b) {
-        if (a.i === that.hilighted_node_id) return -1;
-        if (b.i === that.hilighted_node_id) return 1;
-        if (a.s != b.s) return d3.descending(a.s, b.s);
-        return d3.ascending(a.n, b.n);
-    });
+    if (!this.inFileOrder(data)) {
+        // e.g., after the highlighted node was moved to the front
+        data.sort(function (a,b) {
+            if (a.s != b.s) return d3.descending(a.s, b.s);
+            return d3.ascending(a.n, b.n);
+        });
+    }
+    for (var i = 1; i < data.length; i++) {
+        if (data[i].i === this.hilighted_node_id) {
+            data.unshift(data.splice(i, 1)[0]);
+            break;
+        }
+    }
     
     var visible = data.slice(0, this.N_VISIBLE_IN_COLLAPSED);
     var collapsed = data.slice(this.N_VISIBLE_IN_COLLAPSED);
@@ -213,14 +343,17 @@ TreeOfLifeModel.prototype.expandChildren = function(parent, callback) {
     if (next_scale < this.RESCALE_AT.length-1 &&
         parent.s < this.RESCALE_AT[next_scale+1]*this.root_weight) next_scale++;
     
+    // the leaves before each child, from the files unless rearranged here
+    var offsets_given = this.inFileOrder(parent.c);
+    var first_offset = parent.c.length > 0 ? parent.c[0].o || 0 : 0;
     var child_cumsum = 0;
     var that = this;
     parent.c.forEach(function (d, i) {
         d.index = i
-        if (!d.s) d.s = 1;
+        if (d.g && !d.n) d.n = '(' + d.g.t + ' taxa)';
         d.expanded = false;
         d.parent = parent;
-        d.child_cumsum = child_cumsum;
+        d.child_cumsum = offsets_given ? (d.o || 0) - first_offset : child_cumsum;
         d.level = level;
         d.scale_level = next_scale;
         d.scaled_weight = d.s / that.RESCALE_AT[d.scale_level];
@@ -230,7 +363,7 @@ TreeOfLifeModel.prototype.expandChildren = function(parent, callback) {
             parent_link: {}
         };
         
-        child_cumsum += d.s; 
+        child_cumsum = d.child_cumsum + d.s;
         that.visible_node_counter++;
         
         cur_level.splice(insert_pos+i, 0, d);
@@ -272,6 +405,29 @@ TreeOfLifeModel.prototype.fetchSubtree = function(node, callback) {
     }
 }
 
+/* Replaces the children of a node of a level-of-detail subtree, including
+ * its aggregate node, with the full detail, if loaded */
+TreeOfLifeModel.prototype.replaceWithFullDetail = function(node, subtree_id) {
+    var full = this.backend.fullNode(subtree_id, node.i);
+    if (!full) return false;
+    
+    var wasExpanded = node.expanded;
+    if (wasExpanded) this.removeChildren(node);
+    node.c = full.c;
+    if (wasExpanded) this.expandChildren(node);
+    return true;
+}
+
+TreeOfLifeModel.prototype.expandAggregate = function(node, callback) {
+    var that = this;
+    var parent = node.parent;
+    var loaded = this.backend.fetchFull(node.g.f, function () {
+        that.replaceWithFullDetail(parent, node.g.f);
+        if (callback) callback();
+    });
+    if (loaded) this.replaceWithFullDetail(parent, node.g.f);
+}
+
 TreeOfLifeModel.prototype.expandToNode = function(node_id) {
     var path = [node_id];
     
@@ -292,13 +448,15 @@ TreeOfLifeModel.prototype.expandToNode = function(node_id) {
         }
         else break;
         
-        var next_tree = null;
-        for (var j in tree.c) {
-            var c = tree.c[j];
-            if (c.i == child_id) { 
-                next_tree = c;
-                break;
-            }
+        var next_tree = this.findChild(tree, child_id);
+        if (!next_tree) {
+            // the child may be behind an aggregate of a level-of-detail subtree
+            var aggregates = this.reexpandLargeLevel(tree.c).filter(function (c) {
+                return !!c.g;
+            });
+            if (aggregates.length > 0 &&
+                this.replaceWithFullDetail(tree, aggregates[0].g.f))
+                next_tree = this.findChild(tree, child_id);
         }
         if (!next_tree) {
             console.error("could not find child "+child_id+" from "+tree.i);
@@ -308,6 +466,14 @@ TreeOfLifeModel.prototype.expandToNode = function(node_id) {
     }
 }
 
+TreeOfLifeModel.prototype.findChild = function(node, child_id) {
+    for (var j in node.c) {
+        var c = node.c[j];
+        if (c.i == child_id) return c;
+    }
+    return null;
+}
+
 TreeOfLifeModel.prototype.toggleExpand = function(node, callback) {
     if (node.expanded) {
         this.removeChildren(node);
@@ -130,6 +130,10 @@ function TreeOfLifeView() {
             view.model.rotateArtificialBranch(node);
             updateAgain();
             
+        } else if (node.g) {
+            view.model.expandAggregate(node, updateAgain);
+            updateAgain();
+            
         } else if (node.c) {
             view.model.toggleExpand(node, updateAgain);
             updateAgain();